@@ -6,19 +6,40 @@
 // See LICENSE for details.
 //-----------------------------------------------------------------------------
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <new>
+#include <string>
 
 #include <FreeImage.h>
 
 #include "decoder.h"
 #include "encoder.h"
 
+// Count all heap allocations, so that we can tell how many allocations a
+// decode operation performs.
+std::atomic<long> g_num_allocations(0);
+
+void *operator new(std::size_t size) {
+  ++g_num_allocations;
+  void *ptr = std::malloc(size);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
 namespace {
 
-const int kNumIterations = 30;
+const int kDefaultNumIterations = 30;
 
 enum BenchmarkMode {
   Decode,
@@ -42,15 +63,20 @@ class TimeMeasure {
 };
 
 bool IsHimg(const std::vector<uint8_t> &buffer) {
-  return buffer.size() >= 12 && buffer[0] == 'R' && buffer[1] == 'I' &&
-         buffer[2] == 'F' && buffer[3] == 'F' && buffer[8] == 'H' &&
-         buffer[9] == 'I' && buffer[10] == 'M' && buffer[11] == 'G';
+  himg::Decoder::ImageInfo info;
+  return himg::Decoder::Probe(
+      buffer.data(), static_cast<int>(buffer.size()), &info);
 }
 
 void ShowUsage(const char *arg0) {
-  std::cout << "Usage: " << arg0 << " [-d][-e] image" << std::endl;
-  std::cout << "  -d Decode (default)" << std::endl;
-  std::cout << "  -e Encode" << std::endl;
+  std::cout << "Usage: " << arg0 << " [-d][-e][-n N][-t N][-p] image"
+            << std::endl;
+  std::cout << "  -d   Decode (default)" << std::endl;
+  std::cout << "  -e   Encode" << std::endl;
+  std::cout << "  -n N Number of iterations (default: " << kDefaultNumIterations
+            << ")" << std::endl;
+  std::cout << "  -t N Maximum number of threads (default: all)" << std::endl;
+  std::cout << "  -p   Pin worker threads to CPU cores" << std::endl;
 }
 
 bool LoadFile(const std::string &file_name, std::vector<uint8_t> *buffer) {
@@ -79,14 +105,27 @@ bool LoadFile(const std::string &file_name, std::vector<uint8_t> *buffer) {
 int main(int argc, const char **argv) {
   // Parse arguments.
   BenchmarkMode benchmark_mode = Decode;
+  int num_iterations = kDefaultNumIterations;
+  int max_threads = 0;
+  himg::ThreadPool::Config pool_config;
   std::string file_name;
   for (int i = 1; i < argc; ++i) {
     const char *arg = argv[i];
     if (arg[0] == '-' && arg[1] != 0 && arg[2] == 0) {
-      if (arg[1] == 'd')
+      if (arg[1] == 'd') {
         benchmark_mode = Decode;
-      else if (arg[1] == 'e')
+      } else if (arg[1] == 'e') {
         benchmark_mode = Encode;
+      } else if (arg[1] == 'n' && i + 1 < argc) {
+        num_iterations = std::max(1, std::atoi(argv[++i]));
+      } else if (arg[1] == 't' && i + 1 < argc) {
+        max_threads = std::atoi(argv[++i]);
+      } else if (arg[1] == 'p') {
+        pool_config.pin_threads = true;
+      } else {
+        ShowUsage(argv[0]);
+        return 0;
+      }
     } else if (file_name.empty()) {
       file_name = std::string(arg);
     } else {
@@ -105,13 +144,15 @@ int main(int argc, const char **argv) {
   LoadFile(file_name, &buffer);
 
   FreeImage_Initialise();
-  himg::Decoder himg_decoder;
+  himg::Decoder himg_decoder(max_threads, pool_config);
 
   double min_dt = -1.0, max_dt = -1.0, total_t = 0.0;
-  for (int iteration = 1; iteration <= kNumIterations; ++iteration) {
-    std::cout << "Iteration " << iteration << "/" << kNumIterations
+  long steady_state_allocations = 0;
+  for (int iteration = 1; iteration <= num_iterations; ++iteration) {
+    std::cout << "Iteration " << iteration << "/" << num_iterations
               << std::endl;
 
+    long allocations_before = g_num_allocations;
     TimeMeasure one_measure;
     one_measure.Start();
 
@@ -139,6 +180,12 @@ int main(int argc, const char **argv) {
     }
 
     double dt = one_measure.Duration();
+
+    // Heap allocations after the first iteration are not expected when the
+    // decoder is reused for images of the same size.
+    if (iteration > 1)
+      steady_state_allocations += g_num_allocations - allocations_before;
+
     if (min_dt < 0.0 || dt < min_dt) {
       min_dt = dt;
     }
@@ -148,10 +195,16 @@ int main(int argc, const char **argv) {
     total_t += dt;
   }
 
-  double average = total_t / static_cast<double>(kNumIterations);
+  double average = total_t / static_cast<double>(num_iterations);
   std::cout << "    Min: " << min_dt << " ms\n";
   std::cout << "    Max: " << max_dt << " ms\n";
   std::cout << "Average: " << average << " ms\n";
+  if (num_iterations > 1) {
+    std::cout << "Allocations per iteration (after the first): "
+              << static_cast<double>(steady_state_allocations) /
+                     static_cast<double>(num_iterations - 1)
+              << "\n";
+  }
 
   FreeImage_DeInitialise();
 
@@ -41,32 +41,40 @@ int main(int argc, const char **argv) {
     f.read(reinterpret_cast<char *>(packed_data.data()), file_size);
   }
 
-  // Decode the image.
+  // Read the image dimensions.
   himg::Decoder decoder;
-  if (!decoder.Decode(packed_data.data(), packed_data.size())) {
+  if (!decoder.DecodeInfo(packed_data.data(), packed_data.size())) {
     std::cout << "Unable to decode image." << std::endl;
     return -1;
   }
 
-  // Write the decoded image to a file using FreeImage.
-  {
-    FreeImage_Initialise();
+  FreeImage_Initialise();
 
-    FIBITMAP *bitmap = FreeImage_ConvertFromRawBits(
-        const_cast<BYTE *>(decoder.unpacked_data()),
-        decoder.width(),
-        decoder.height(),
-        decoder.num_channels() * decoder.width(),
-        decoder.num_channels() * 8,
-        0xff0000,
-        0x00ff00,
-        0x0000ff,
-        false);
-    FreeImage_Save(FIF_PNG, bitmap, argv[2]);
+  // Decode the image straight into a FreeImage bitmap.
+  // NOTE: FreeImage stores the bottom row first, and so did the encoder, so we
+  // keep the row order as-is.
+  FIBITMAP *bitmap = FreeImage_Allocate(decoder.width(),
+                                        decoder.height(),
+                                        decoder.num_channels() * 8,
+                                        0xff0000,
+                                        0x00ff00,
+                                        0x0000ff);
+  if (!decoder.Decode(packed_data.data(),
+                      packed_data.size(),
+                      reinterpret_cast<uint8_t *>(FreeImage_GetBits(bitmap)),
+                      FreeImage_GetPitch(bitmap),
+                      false)) {
+    std::cout << "Unable to decode image." << std::endl;
     FreeImage_Unload(bitmap);
-
     FreeImage_DeInitialise();
+    return -1;
   }
 
+  // Write the decoded image to a file using FreeImage.
+  FreeImage_Save(FIF_PNG, bitmap, argv[2]);
+  FreeImage_Unload(bitmap);
+
+  FreeImage_DeInitialise();
+
   return 0;
 }
@@ -0,0 +1,35 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef CANCELLATION_TOKEN_H_
+#define CANCELLATION_TOKEN_H_
+
+#include <atomic>
+
+namespace himg {
+
+// A token that can be used for cancelling an operation that is in progress
+// (e.g. a decoding), from any thread.
+class CancellationToken {
+ public:
+  CancellationToken() : m_cancelled(false) {}
+
+  void Cancel() { m_cancelled.store(true, std::memory_order_release); }
+  void Reset() { m_cancelled.store(false, std::memory_order_release); }
+
+  bool is_cancelled() const {
+    return m_cancelled.load(std::memory_order_acquire);
+  }
+
+ private:
+  std::atomic_bool m_cancelled;
+};
+
+}  // namespace himg
+
+#endif  // CANCELLATION_TOKEN_H_
@@ -11,17 +11,20 @@
 #include <algorithm>
 #include <atomic>
 #include <iostream>
-#include <memory>
-#include <thread>
 #include <vector>
 
 #include "common.h"
 #include "downsampled.h"
 #include "hadamard.h"
 #include "mapper.h"
+#include "pixel_format.h"
 #include "quantize.h"
 #include "ycbcr.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace himg {
 
 namespace {
@@ -33,67 +36,655 @@ uint32_t ToFourcc(const char name[4]) {
          (static_cast<uint32_t>(name[3]) << 24);
 }
 
-void RestoreChannelBlock(uint8_t *out,
-                         const int16_t *in,
-                         int pixel_stride,
-                         int row_stride,
-                         int block_width,
-                         int block_height) {
+// The names of the chunks, indexed by Decoder::Chunk.
+const char *const kChunkNames[] = {
+    "FRMT", "LMAP", "LRES", "QCFG", "FMAP", "FRES"};
+
+// The largest plausible size of a HIMG stream, in addition to twice the size of
+// the uncompressed image (the compressed data is never that large).
+const int64_t kMaxStreamOverhead = 1 << 20;
+
+uint32_t ReadUint32(const uint8_t *data) {
+  return static_cast<uint32_t>(data[0]) |
+         (static_cast<uint32_t>(data[1]) << 8) |
+         (static_cast<uint32_t>(data[2]) << 16) |
+         (static_cast<uint32_t>(data[3]) << 24);
+}
+
+// Check that the data starts with a RIFF HIMG header, and get the size of the
+// RIFF data (including the RIFF header).
+bool ReadRIFFStart(const uint8_t *data,
+                   int size,
+                   bool allow_partial_data,
+                   int *riff_size) {
+  if (size < 12)
+    return false;
+
+  if (data[0] != 'R' || data[1] != 'I' || data[2] != 'F' || data[3] != 'F')
+    return false;
+
+  int file_size = static_cast<int>(ReadUint32(&data[4]));
+  if (allow_partial_data ? file_size + 8 < size : file_size + 8 != size)
+    return false;
+  *riff_size = file_size + 8;
+
+  if (data[8] != 'H' || data[9] != 'I' || data[10] != 'M' || data[11] != 'G')
+    return false;
+
+  return true;
+}
+
+// Read the chunk header at *idx, and advance *idx to the chunk data. Returns
+// false if the chunk is not complete within the data (or if its size is
+// invalid, i.e. negative).
+bool ReadRIFFChunk(const uint8_t *data,
+                   int size,
+                   int *idx,
+                   uint32_t *fourcc,
+                   int *chunk_size) {
+  if (*idx > size - 8)
+    return false;
+
+  *fourcc = ReadUint32(&data[*idx]);
+  *chunk_size = static_cast<int>(ReadUint32(&data[*idx + 4]));
+
+  *idx += 8;
+  return *chunk_size >= 0 && *chunk_size <= size - *idx;
+}
+
+// The supported versions of the file format. Version 2 stores the low-res data
+// of each channel as a separate Huffman block (so that the channels can be
+// decoded in parallel).
+bool IsSupportedVersion(int version) {
+  return version == 1 || version == 2;
+}
+
+// Read the data of the FRMT chunk (any version).
+bool ReadFormat(const uint8_t *chunk_data,
+                int chunk_size,
+                Decoder::ImageInfo *info) {
+  // Check the header size.
+  if (chunk_size < 11)
+    return false;
+
+  info->version = chunk_data[0];
+  info->width = static_cast<int>(ReadUint32(&chunk_data[1]));
+  info->height = static_cast<int>(ReadUint32(&chunk_data[5]));
+  info->num_channels = static_cast<int>(chunk_data[9]);
+  info->use_ycbcr = chunk_data[10] != 0;
+
+  return true;
+}
+
+// Convert a YCbCr value (already clamped to 8 bits) to RGB, without clamping
+// the result. This is the same transform as YCbCr::YCbCrToRGB().
+inline void ToRGB(int16_t y,
+                  int16_t cb,
+                  int16_t cr,
+                  int16_t *r,
+                  int16_t *g,
+                  int16_t *b) {
+  cb = (cb << 1) - 255;
+  cr = (cr << 1) - 255;
+  *g = y - ((cb + cr + 2) >> 2);
+  *b = *g + cb;
+  *r = *g + cr;
+}
+
+#if defined(__SSE2__)
+// Store one row of eight pixels with N (one to four) channels. Channel k of
+// the pixels is in the k:th vector of 16-bit values. With ycbcr, the first
+// three channels are converted from YCbCr to RGB.
+template <int N>
+inline void StorePixelRow(uint8_t *out,
+                          __m128i c0,
+                          __m128i c1,
+                          __m128i c2,
+                          __m128i c3,
+                          bool ycbcr) {
+  if (N >= 3 && ycbcr) {
+    // Clamp the YCbCr values to 8 bits first, as the scalar code does.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i y = _mm_max_epi16(_mm_min_epi16(c0, max), zero);
+    const __m128i cb = _mm_sub_epi16(
+        _mm_slli_epi16(_mm_max_epi16(_mm_min_epi16(c1, max), zero), 1), max);
+    const __m128i cr = _mm_sub_epi16(
+        _mm_slli_epi16(_mm_max_epi16(_mm_min_epi16(c2, max), zero), 1), max);
+    c1 = _mm_sub_epi16(
+        y,
+        _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(cb, cr), _mm_set1_epi16(2)),
+                       2));
+    c0 = _mm_add_epi16(c1, cr);
+    c2 = _mm_add_epi16(c1, cb);
+  }
+
+  // Clamp to 8 bits and interleave the channels.
+  const __m128i c01 = _mm_packus_epi16(c0, c1);
+  if (N == 1) {
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out), c01);
+    return;
+  }
+  const __m128i p01 = _mm_unpacklo_epi8(c01, _mm_srli_si128(c01, 8));
+  if (N == 2) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), p01);
+    return;
+  }
+  const __m128i c23 = _mm_packus_epi16(c2, c3);
+  const __m128i p23 = _mm_unpacklo_epi8(c23, _mm_srli_si128(c23, 8));
+  const __m128i p0 = _mm_unpacklo_epi16(p01, p23);
+  const __m128i p1 = _mm_unpackhi_epi16(p01, p23);
+  if (N == 4) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), p0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), p1);
+    return;
+  }
+
+  // Squeeze out the (zero) fourth byte of each pixel: first within each 64-bit
+  // half, and then between the halves.
+  const __m128i low_dwords = _mm_set_epi32(0, -1, 0, -1);
+  const __m128i low_qword = _mm_set_epi32(0, 0, -1, -1);
+  __m128i q0 = _mm_or_si128(
+      _mm_and_si128(p0, low_dwords),
+      _mm_srli_epi64(_mm_andnot_si128(low_dwords, p0), 8));
+  __m128i q1 = _mm_or_si128(
+      _mm_and_si128(p1, low_dwords),
+      _mm_srli_epi64(_mm_andnot_si128(low_dwords, p1), 8));
+  q0 = _mm_or_si128(_mm_and_si128(q0, low_qword),
+                    _mm_srli_si128(_mm_andnot_si128(low_qword, q0), 2));
+  q1 = _mm_or_si128(_mm_and_si128(q1, low_qword),
+                    _mm_srli_si128(_mm_andnot_si128(low_qword, q1), 2));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                   _mm_or_si128(q0, _mm_slli_si128(q1, 12)));
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 16),
+                   _mm_srli_si128(q1, 4));
+}
+
+// Store full (8 pixels wide) blocks of N channels as tightly packed pixels.
+template <int N>
+void RestorePixelBlockSIMD(uint8_t *out,
+                           const int16_t *in,
+                           int row_stride,
+                           int block_height,
+                           bool ycbcr) {
+  const __m128i zero = _mm_setzero_si128();
   for (int y = 0; y < block_height; y++) {
-    if (LIKELY(block_width == 8)) {
-      // Fast path.
-      for (int i = 0; i < 2; ++i) {
-        int16_t c1 = *in++;
-        int16_t c2 = *in++;
-        int16_t c3 = *in++;
-        int16_t c4 = *in++;
-        if (LIKELY(((c1 | c2 | c3 | c4) & 0xff00) == 0)) {
-          out[0] = static_cast<uint8_t>(c1);
-          out[pixel_stride] = static_cast<uint8_t>(c2);
-          out[2 * pixel_stride] = static_cast<uint8_t>(c3);
-          out[3 * pixel_stride] = static_cast<uint8_t>(c4);
-        } else {
-          out[0] = ClampTo8Bit(c1);
-          out[pixel_stride] = ClampTo8Bit(c2);
-          out[2 * pixel_stride] = ClampTo8Bit(c3);
-          out[3 * pixel_stride] = ClampTo8Bit(c4);
-        }
-        out += 4 * pixel_stride;
+    const __m128i *row = reinterpret_cast<const __m128i *>(in + y * 8);
+    StorePixelRow<N>(out,
+                     _mm_loadu_si128(row),
+                     N >= 2 ? _mm_loadu_si128(row + 8) : zero,
+                     N >= 3 ? _mm_loadu_si128(row + 16) : zero,
+                     N >= 4 ? _mm_loadu_si128(row + 24) : zero,
+                     ycbcr);
+    out += row_stride;
+  }
+}
+#endif
+
+// Store the reconstructed blocks of num_channels channels as interleaved
+// pixels, clamped to 8 bits. The values of channel k are 64 elements after the
+// values of channel k - 1. With ycbcr, the first three channels are converted
+// from YCbCr to RGB.
+void RestorePixelBlock(uint8_t *out,
+                       const int16_t *in,
+                       int num_channels,
+                       int pixel_stride,
+                       int row_stride,
+                       int block_width,
+                       int block_height,
+                       bool ycbcr) {
+#if defined(__SSE2__)
+  if (LIKELY(block_width == 8 && pixel_stride == num_channels)) {
+    // Fast path.
+    switch (num_channels) {
+      case 1:
+        RestorePixelBlockSIMD<1>(out, in, row_stride, block_height, ycbcr);
+        return;
+      case 2:
+        RestorePixelBlockSIMD<2>(out, in, row_stride, block_height, ycbcr);
+        return;
+      case 3:
+        RestorePixelBlockSIMD<3>(out, in, row_stride, block_height, ycbcr);
+        return;
+      case 4:
+        RestorePixelBlockSIMD<4>(out, in, row_stride, block_height, ycbcr);
+        return;
+      default:
+        break;
+    }
+  }
+#endif
+
+  for (int y = 0; y < block_height; y++) {
+    const int16_t *src = in + y * 8;
+    uint8_t *dst = out;
+    for (int x = 0; x < block_width; x++) {
+      int chan = 0;
+      if (ycbcr) {
+        int16_t r, g, b;
+        ToRGB(ClampTo8Bit(src[0]),
+              ClampTo8Bit(src[64]),
+              ClampTo8Bit(src[128]),
+              &r,
+              &g,
+              &b);
+        dst[0] = ClampTo8Bit(r);
+        dst[1] = ClampTo8Bit(g);
+        dst[2] = ClampTo8Bit(b);
+        chan = 3;
       }
+      for (; chan < num_channels; ++chan)
+        dst[chan] = ClampTo8Bit(src[chan * 64]);
+      ++src;
+      dst += pixel_stride;
+    }
+    out += row_stride;
+  }
+}
+
+}  // namespace
+
+Decoder::Decoder(int max_threads, const ThreadPool::Config &pool_config)
+    : m_thread_pool(new ThreadPool(max_threads, pool_config)),
+      m_executor(m_thread_pool.get()),
+      m_worker_scratch(m_executor->num_workers()),
+      m_pixel_format(PixelFormat::kNative),
+      m_premultiply_alpha(false),
+      m_scale_shift(0),
+      m_progress_listener(nullptr),
+      m_row_sink(nullptr),
+      m_row_sink_ordered(true),
+      m_channel_mask(kAllChannels),
+      m_restore_block_row(nullptr),
+      m_cancellation_token(nullptr),
+      m_deadline(TimePoint::max()),
+      m_cancelled(false),
+      m_stream_state(StreamState::kFailed) {
+}
+
+Decoder::Decoder(Executor *executor)
+    : m_executor(executor),
+      m_worker_scratch(m_executor->num_workers()),
+      m_pixel_format(PixelFormat::kNative),
+      m_premultiply_alpha(false),
+      m_scale_shift(0),
+      m_progress_listener(nullptr),
+      m_row_sink(nullptr),
+      m_row_sink_ordered(true),
+      m_channel_mask(kAllChannels),
+      m_restore_block_row(nullptr),
+      m_cancellation_token(nullptr),
+      m_deadline(TimePoint::max()),
+      m_cancelled(false),
+      m_stream_state(StreamState::kFailed) {
+}
+
+bool Decoder::Decode(const uint8_t *packed_data, int packed_size) {
+  return DecodeImage(packed_data, packed_size, nullptr, nullptr, 0, false);
+}
+
+bool Decoder::Decode(const uint8_t *packed_data,
+                     int packed_size,
+                     uint8_t *out,
+                     int row_stride,
+                     bool bottom_up) {
+  if (!out)
+    return false;
+  return DecodeImage(
+      packed_data, packed_size, nullptr, out, row_stride, bottom_up);
+}
+
+bool Decoder::DecodeRegion(const uint8_t *packed_data,
+                           int packed_size,
+                           int x,
+                           int y,
+                           int width,
+                           int height) {
+  const Rect region = {x, y, width, height};
+  return DecodeImage(packed_data, packed_size, &region, nullptr, 0, false);
+}
+
+bool Decoder::DecodeRegion(const uint8_t *packed_data,
+                           int packed_size,
+                           int x,
+                           int y,
+                           int width,
+                           int height,
+                           uint8_t *out,
+                           int row_stride,
+                           bool bottom_up) {
+  if (!out)
+    return false;
+  const Rect region = {x, y, width, height};
+  return DecodeImage(
+      packed_data, packed_size, &region, out, row_stride, bottom_up);
+}
+
+bool Decoder::DecodeThumbnail(const uint8_t *packed_data,
+                              int packed_size,
+                              bool smooth) {
+  return DecodeThumbnailImage(
+      packed_data, packed_size, smooth, nullptr, 0, false);
+}
+
+bool Decoder::DecodeThumbnail(const uint8_t *packed_data,
+                              int packed_size,
+                              bool smooth,
+                              uint8_t *out,
+                              int row_stride,
+                              bool bottom_up) {
+  if (!out)
+    return false;
+  return DecodeThumbnailImage(
+      packed_data, packed_size, smooth, out, row_stride, bottom_up);
+}
+
+bool Decoder::DecodeBatch(BatchImage *images, int num_images) {
+  // One single-threaded decoder per worker, created on first use.
+  const int num_workers = m_executor->num_workers();
+  while (static_cast<int>(m_batch_decoders.size()) < num_workers)
+    m_batch_decoders.emplace_back(new Decoder(1));
+  for (auto &decoder : m_batch_decoders) {
+    decoder->SetPixelFormat(m_pixel_format, m_premultiply_alpha);
+    decoder->SetScale(1 << m_scale_shift);
+    decoder->SetChannelMask(m_channel_mask);
+    decoder->SetCancellationToken(m_cancellation_token);
+    decoder->SetDeadline(m_deadline);
+  }
+
+  // Decode the large images first, one at a time with the block rows in
+  // parallel. The small images are decoded last, so that the whole-image tasks
+  // fill up the workers at the end of the batch (a large image leaves workers
+  // idle while its last block rows are decoded).
+  ProgressListener *progress_listener = m_progress_listener;
+  RowSink *row_sink = m_row_sink;
+  m_progress_listener = nullptr;
+  m_row_sink = nullptr;
+  m_batch_small_images.clear();
+  for (int i = 0; i < num_images; ++i) {
+    BatchImage &image = images[i];
+    if (IsLargeBatchImage(image)) {
+      image.success = Decode(image.packed_data,
+                             image.packed_size,
+                             image.out,
+                             image.row_stride,
+                             image.bottom_up);
     } else {
-      // Slow path.
-      for (int y = 0; y < block_height; y++) {
-        for (int x = 0; x < block_width; x++) {
-          *out = ClampTo8Bit(*in++);
-          out += pixel_stride;
-        }
-        in += 8 - block_width;
+      m_batch_small_images.push_back(i);
+    }
+  }
+  m_progress_listener = progress_listener;
+  m_row_sink = row_sink;
+
+  // Decode the small images in parallel, one image per task.
+  auto decode_image = [this, images](int i, int worker) {
+    BatchImage &image = images[m_batch_small_images[i]];
+    image.success = m_batch_decoders[worker]->Decode(image.packed_data,
+                                                     image.packed_size,
+                                                     image.out,
+                                                     image.row_stride,
+                                                     image.bottom_up);
+  };
+  m_executor->Run(static_cast<int>(m_batch_small_images.size()),
+                  decode_image);
+
+  bool success = true;
+  for (int i = 0; i < num_images; ++i)
+    success = success && images[i].success;
+
+  return success;
+}
+
+bool Decoder::IsLargeBatchImage(const BatchImage &image) const {
+  // An image is large enough to keep all the workers busy (with some room for
+  // load balancing) if it has a few block rows per worker.
+  ImageInfo info;
+  if (!Probe(image.packed_data, image.packed_size, &info))
+    return false;
+  const int num_block_rows = (info.height + 7) >> 3;
+  return num_block_rows >= 4 * m_executor->num_workers();
+}
+
+bool Decoder::DecodeInfo(const uint8_t *packed_data, int packed_size) {
+  return DecodeStart(packed_data, packed_size, true);
+}
+
+void Decoder::Begin(uint8_t *out, int row_stride, bool bottom_up) {
+  m_stream_state = StreamState::kRIFFStart;
+  m_stream_data.clear();
+  m_stream_chunk = kFormatChunk;
+  m_stream_huffman_ready = false;
+  m_stream_rows_done = 0;
+  m_stream_out = out;
+  m_stream_row_stride = row_stride;
+  m_stream_bottom_up = bottom_up;
+  m_cancelled = false;
+  m_packed_data = nullptr;
+  m_packed_size = 0;
+  m_packed_idx = 0;
+}
+
+bool Decoder::Feed(const uint8_t *data, int size) {
+  if (m_stream_state == StreamState::kFailed)
+    return false;
+
+  // The data must not extend past the end of the RIFF data.
+  if (size < 0 || (m_stream_state != StreamState::kRIFFStart &&
+                   size > m_riff_size - m_packed_size)) {
+    std::cout << "Too much HIMG data.\n";
+    m_stream_state = StreamState::kFailed;
+    return false;
+  }
+
+  // Note: Once the format chunk has been decoded, the buffer has room for all
+  // the data, so pointers into it (e.g. into the full-res data) stay valid.
+  m_stream_data.insert(m_stream_data.end(), data, data + size);
+  m_packed_data = m_stream_data.data();
+  m_packed_size = static_cast<int>(m_stream_data.size());
+
+  if (!DecodeAvailableData()) {
+    m_stream_state = StreamState::kFailed;
+    return false;
+  }
+  return true;
+}
+
+bool Decoder::Finish() {
+  if (m_stream_state != StreamState::kDone || m_packed_size != m_riff_size) {
+    if (m_stream_state != StreamState::kFailed)
+      std::cout << "Incomplete HIMG data.\n";
+    m_stream_state = StreamState::kFailed;
+    return false;
+  }
+  return true;
+}
+
+bool Decoder::DecodeAvailableData() {
+  // Check that this is a RIFF HIMG file.
+  if (m_stream_state == StreamState::kRIFFStart) {
+    if (m_packed_size < 12)
+      return true;
+    if (!DecodeRIFFStart(true)) {
+      std::cout << "Not a RIFF HIMG file.\n";
+      return false;
+    }
+    m_stream_state = StreamState::kChunks;
+  }
+
+  if (m_stream_state == StreamState::kChunks && !DecodeAvailableChunks())
+    return false;
+
+  if (m_stream_state == StreamState::kFullRes && !DecodeAvailableFullRes())
+    return false;
+
+  return true;
+}
+
+bool Decoder::DecodeAvailableChunks() {
+  while (m_packed_idx + 8 <= m_packed_size) {
+    // Read the chunk header.
+    const int chunk_start = m_packed_idx;
+    uint32_t fourcc;
+    int chunk_size;
+    const bool complete = DecodeRIFFChunk(&fourcc, &chunk_size);
+    if (chunk_size < 0 || chunk_size > m_riff_size - m_packed_idx) {
+      std::cout << "Invalid RIFF chunk size.\n";
+      return false;
+    }
+    const bool expected = fourcc == ToFourcc(kChunkNames[m_stream_chunk]);
+
+    // The full resolution data is decoded block row by block row as it
+    // arrives.
+    if (expected && m_stream_chunk == kFullResChunk) {
+      m_stream_fres_idx = m_packed_idx;
+      m_stream_fres_size = chunk_size;
+      m_stream_huffman_block_size = PrepareFullRes();
+      m_stream_state = StreamState::kFullRes;
+      return true;
+    }
+
+    // Wait for the rest of the chunk.
+    if (!complete) {
+      m_packed_idx = chunk_start;
+      return true;
+    }
+
+    // Skip unrecognized chunks.
+    if (!expected) {
+      m_packed_idx += chunk_size;
+      continue;
+    }
+
+    // Decode the chunk.
+    m_packed_idx = chunk_start;
+    if (m_stream_chunk == kFormatChunk) {
+      if (!DecodeHeader()) {
+        std::cout << "Error decoding header.\n";
+        return false;
       }
+
+      // The RIFF size is not trusted until it can be checked against the image
+      // size, and then room is made for all the data at once.
+      const int64_t raw_size =
+          static_cast<int64_t>(m_width) * m_height * m_num_channels;
+      if (m_riff_size > 2 * raw_size + kMaxStreamOverhead) {
+        std::cout << "Invalid RIFF size.\n";
+        return false;
+      }
+      m_stream_data.reserve(m_riff_size);
+      m_packed_data = m_stream_data.data();
+
+      if (!PrepareOutput(
+              nullptr, m_stream_out, m_stream_row_stride, m_stream_bottom_up))
+        return false;
+    } else if (!DecodeChunk(static_cast<Chunk>(m_stream_chunk))) {
+      return false;
     }
-    out += row_stride - (pixel_stride * block_width);
+    ++m_stream_chunk;
   }
+
+  return true;
 }
 
-}  // namespace
+bool Decoder::DecodeAvailableFullRes() {
+  const uint8_t *chunk_data = m_packed_data + m_stream_fres_idx;
+  const int available =
+      std::min(m_packed_size - m_stream_fres_idx, m_stream_fres_size);
+  const bool complete = available == m_stream_fres_size;
 
-Decoder::Decoder(int max_threads) {
-  if (max_threads <= 0) {
-    m_max_threads = std::thread::hardware_concurrency();
+  // Decode the Huffman tree once it has arrived. Unblocked data (a single
+  // block row) can only be uncompressed once the entire chunk has arrived.
+  if (!m_stream_huffman_ready) {
+    if (m_stream_huffman_block_size == 0 && !complete)
+      return true;
+    if (!m_huffman_dec.Init(
+            chunk_data, available, m_stream_huffman_block_size)) {
+      if (!complete)
+        return true;
+      std::cout << "Error: Invalid Huffman data.\n";
+      return false;
+    }
+    m_stream_huffman_ready = true;
   } else {
-    m_max_threads = max_threads;
+    m_huffman_dec.SetInputSize(available);
   }
+
+  // Decode the block rows that have arrived since the last time.
+  const int num_rows = NumBlockRows();
+  int rows_ready;
+  if (m_stream_huffman_block_size == 0)
+    rows_ready = complete ? num_rows : 0;
+  else
+    rows_ready = std::min(m_huffman_dec.num_blocks(), num_rows);
+  if (rows_ready > m_stream_rows_done) {
+    if (!DecodeFullResBlockRows(m_stream_rows_done,
+                                rows_ready - m_stream_rows_done)) {
+      if (!m_cancelled)
+        std::cout << "Error decoding full-res data.\n";
+      return false;
+    }
+    m_stream_rows_done = rows_ready;
+  }
+
+  if (complete) {
+    if (m_stream_rows_done != num_rows) {
+      std::cout << "Error decoding full-res data.\n";
+      return false;
+    }
+    m_packed_idx = m_stream_fres_idx + m_stream_fres_size;
+    m_stream_state = StreamState::kDone;
+  }
+
+  return true;
 }
 
-bool Decoder::Decode(const uint8_t *packed_data, int packed_size) {
+bool Decoder::Probe(const uint8_t *packed_data,
+                    int packed_size,
+                    ImageInfo *info) {
+  int riff_size;
+  if (!ReadRIFFStart(packed_data, packed_size, true, &riff_size))
+    return false;
+
+  // Locate the chunks (the first one of each kind).
+  ImageInfo::ChunkLocation *const locations[] = {&info->format,
+                                                 &info->low_res_mapping,
+                                                 &info->low_res,
+                                                 &info->quantization,
+                                                 &info->full_res_mapping,
+                                                 &info->full_res};
+  for (auto *location : locations)
+    location->offset = location->size = 0;
+  int idx = 12;
+  uint32_t fourcc;
+  int chunk_size;
+  while (ReadRIFFChunk(packed_data, packed_size, &idx, &fourcc, &chunk_size)) {
+    for (int i = 0; i <= kFullResChunk; ++i) {
+      if (fourcc == ToFourcc(kChunkNames[i]) && locations[i]->offset == 0) {
+        locations[i]->offset = idx;
+        locations[i]->size = chunk_size;
+      }
+    }
+    idx += chunk_size;
+  }
+
+  // The image information is in the FRMT chunk.
+  if (info->format.offset == 0)
+    return false;
+  const uint8_t *chunk_data = packed_data + info->format.offset;
+  return ReadFormat(chunk_data, info->format.size, info) &&
+         IsSupportedVersion(info->version);
+}
+
+bool Decoder::DecodeStart(const uint8_t *packed_data,
+                          int packed_size,
+                          bool allow_partial_data) {
   m_packed_data = packed_data;
   m_packed_size = packed_size;
   m_packed_idx = 0;
-
-  m_unpacked_data.clear();
-  m_downsampled.clear();
+  m_cancelled = false;
 
   // Check that this is a RIFF HIMG file.
-  if (!DecodeRIFFStart()) {
+  if (!DecodeRIFFStart(allow_partial_data)) {
     std::cout << "Not a RIFF HIMG file.\n";
     return false;
   }
@@ -104,6 +695,210 @@ bool Decoder::Decode(const uint8_t *packed_data, int packed_size) {
     return false;
   }
 
+  return true;
+}
+
+void Decoder::DecodeAsync(const uint8_t *packed_data,
+                          int packed_size,
+                          uint8_t *out,
+                          int row_stride,
+                          bool bottom_up,
+                          const DoneCallback &on_done) {
+  if (!DecodeImageStart(
+          packed_data, packed_size, nullptr, out, row_stride, bottom_up)) {
+    on_done(false);
+    return;
+  }
+
+  // Decode the full resolution data in the background.
+  m_async_done = on_done;
+  m_first_block_row = 0;
+  m_block_rows_ok = true;
+  auto decode_row = [this](int v, int worker) {
+    DecodeFullResBlockRowTask(v, worker);
+  };
+  auto finish = [this]() {
+    DoneCallback on_done;
+    std::swap(on_done, m_async_done);
+    on_done(m_block_rows_ok);
+  };
+  m_executor->Submit(NumBlockRows(), decode_row, finish);
+}
+
+std::future<bool> Decoder::DecodeAsync(const uint8_t *packed_data,
+                                       int packed_size,
+                                       uint8_t *out,
+                                       int row_stride,
+                                       bool bottom_up) {
+  auto promise = std::make_shared<std::promise<bool>>();
+  std::future<bool> result = promise->get_future();
+  DecodeAsync(packed_data,
+              packed_size,
+              out,
+              row_stride,
+              bottom_up,
+              [promise](bool success) { promise->set_value(success); });
+  return result;
+}
+
+bool Decoder::DecodeImage(const uint8_t *packed_data,
+                          int packed_size,
+                          const Rect *region,
+                          uint8_t *out,
+                          int row_stride,
+                          bool bottom_up) {
+  if (!DecodeImageStart(
+          packed_data, packed_size, region, out, row_stride, bottom_up))
+    return false;
+
+  // Full resolution data.
+  if (!DecodeFullResBlockRows(0, NumBlockRows())) {
+    if (!m_cancelled)
+      std::cout << "Error decoding full-res data.\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool Decoder::DecodeImageStart(const uint8_t *packed_data,
+                               int packed_size,
+                               const Rect *region,
+                               uint8_t *out,
+                               int row_stride,
+                               bool bottom_up) {
+  // Check that this is a RIFF HIMG file, and read the header data.
+  if (!DecodeStart(packed_data, packed_size, false))
+    return false;
+
+  if (!PrepareOutput(region, out, row_stride, bottom_up))
+    return false;
+
+  // Decode the low resolution data and the full resolution configuration.
+  for (int chunk = kLowResMappingChunk; chunk < kFullResChunk; ++chunk) {
+    if (!DecodeChunk(static_cast<Chunk>(chunk)))
+      return false;
+  }
+
+  // Prepare the decoding of the full resolution data.
+  if (!StartFullRes()) {
+    std::cout << "Error decoding full-res data.\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool Decoder::PrepareOutput(const Rect *region,
+                            uint8_t *out,
+                            int row_stride,
+                            bool bottom_up) {
+  // The region must be a non-empty part of the (scaled) image.
+  if (region) {
+    if (region->x < 0 || region->y < 0 || region->width <= 0 ||
+        region->height <= 0 || region->width > m_output_width - region->x ||
+        region->height > m_output_height - region->y) {
+      std::cout << "Invalid region.\n";
+      return false;
+    }
+    m_region = *region;
+    m_output_width = region->width;
+    m_output_height = region->height;
+  }
+
+  if (!CheckPixelFormat() || !SetOutputBuffer(out, row_stride, bottom_up))
+    return false;
+
+  // Prepare the band buffers (for pixel format or channel conversion, and for
+  // the row sink).
+  if (NeedsOutputConversion() || m_row_sink) {
+    for (auto &scratch : m_worker_scratch)
+      scratch.band.resize(8 * m_output_width * m_num_channels);
+  }
+  const int num_planes =
+      NeedsOutputConversion()
+          ? PixelFormatConverter::NumPlanes(m_pixel_format, m_num_channels)
+          : 1;
+  if (NeedsOutputConversion() && m_row_sink) {
+    for (auto &scratch : m_worker_scratch)
+      scratch.sink_band.resize(8 * output_row_size() * num_planes);
+  }
+  if (m_row_sink && m_row_sink_ordered) {
+    const int window_size = kRowSinkWindowSize * m_executor->num_workers();
+    m_row_sink_row_size = output_row_size() * num_planes;
+    m_row_sink_window.resize(window_size * 8 * m_row_sink_row_size);
+    m_row_sink_window_rows.assign(window_size, std::make_pair(0, 0));
+  }
+  m_row_sink_next_row = m_region.y >> (3 - m_scale_shift);
+  m_row_sink_failed = false;
+
+  return true;
+}
+
+bool Decoder::DecodeChunk(Chunk chunk) {
+  switch (chunk) {
+    case kLowResMappingChunk:
+      // Low resolution mapping table.
+      if (!DecodeLowResMappingFunction()) {
+        std::cout << "Error decoding low-res mapping function.\n";
+        return false;
+      }
+      return true;
+
+    case kLowResChunk:
+      // Lowres data.
+      if (!DecodeLowRes()) {
+        std::cout << "Error decoding low-res data.\n";
+        return false;
+      }
+
+      // Give the progress listener a preview of the image (there is no image
+      // buffer to draw the preview in with a row sink).
+      if (m_progress_listener) {
+        if (!m_row_sink)
+          DecodePreview();
+        m_progress_listener->OnPreview();
+      }
+      return true;
+
+    case kQuantizationChunk:
+      // Quantization table.
+      if (!DecodeQuantizationConfig()) {
+        std::cout << "Error decoding quantization configuration.\n";
+        return false;
+      }
+      return true;
+
+    case kFullResMappingChunk:
+      // Full resolution mapping table.
+      if (!DecodeFullResMappingFunction()) {
+        std::cout << "Error decoding full-res mapping function.\n";
+        return false;
+      }
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+bool Decoder::DecodeThumbnailImage(const uint8_t *packed_data,
+                                   int packed_size,
+                                   bool smooth,
+                                   uint8_t *out,
+                                   int row_stride,
+                                   bool bottom_up) {
+  // Check that this is a RIFF HIMG file, and read the header data.
+  if (!DecodeStart(packed_data, packed_size, true))
+    return false;
+
+  // The thumbnail has one pixel per 8x8 block.
+  m_output_width = (m_width + 7) >> 3;
+  m_output_height = (m_height + 7) >> 3;
+
+  if (!CheckPixelFormat() || !SetOutputBuffer(out, row_stride, bottom_up))
+    return false;
+
   // Low resolution mapping table.
   if (!DecodeLowResMappingFunction()) {
     std::cout << "Error decoding low-res mapping function.\n";
@@ -116,48 +911,211 @@ bool Decoder::Decode(const uint8_t *packed_data, int packed_size) {
     return false;
   }
 
-  // Quantization table.
-  if (!DecodeQuantizationConfig()) {
-    std::cout << "Error decoding quantization configuration.\n";
-    return false;
+  // Native pixels are written straight to the output buffer. For other pixel
+  // formats (and for the row sink), each row is put together in a band buffer
+  // first.
+  const int num_channels = m_num_decoded_channels;
+  const bool convert = NeedsOutputConversion();
+  const bool use_band = convert || m_row_sink != nullptr;
+  std::vector<uint8_t> &band = m_worker_scratch.back().band;
+  if (use_band)
+    band.resize(m_output_width * num_channels);
+  std::vector<uint8_t> &sink_band = m_worker_scratch.back().sink_band;
+  if (convert && m_row_sink) {
+    sink_band.resize(
+        output_row_size() *
+        PixelFormatConverter::NumPlanes(m_pixel_format, m_num_channels));
   }
 
-  // Full resolution mapping table.
-  if (!DecodeFullResMappingFunction()) {
-    std::cout << "Error decoding full-res mapping function.\n";
-    return false;
+  for (int v = 0; v < m_output_height; ++v) {
+    uint8_t *row = use_band ? band.data() : OutputRow(v);
+    for (int chan = 0; chan < m_num_used_channels; ++chan) {
+      if (m_channel_offsets[chan] >= 0) {
+        m_downsampled[chan].GetThumbnailRow(
+            row + m_channel_offsets[chan], num_channels, v, smooth);
+      }
+    }
+
+    // Do YCbCr->RGB conversion if necessary.
+    if (NeedsColorConversion())
+      YCbCr::YCbCrToRGB(row, m_output_width, 1, num_channels);
+
+    // The rows are decoded in order, so they are delivered to the row sink
+    // right away.
+    if (m_row_sink) {
+      const uint8_t *data = row;
+      if (convert) {
+        StoreOutputRow(
+            sink_band.data(), output_row_size(), row, m_output_width);
+        data = sink_band.data();
+      }
+      m_row_sink->OnRows(v, 1, data, output_row_size());
+    } else if (convert) {
+      StoreOutputRow(OutputRow(v), m_out_plane_stride, row, m_output_width);
+    }
   }
 
-  // Full resolution data.
-  if (!DecodeFullRes()) {
-    std::cout << "Error decoding full-res data.\n";
+  return true;
+}
+
+bool Decoder::CheckPixelFormat() const {
+  // Only images with one to four channels can be converted to other formats.
+  if (m_pixel_format != PixelFormat::kNative &&
+      (m_num_channels < 1 || m_num_channels > 4)) {
+    std::cout << "Unsupported number of channels for the pixel format.\n";
     return false;
   }
 
+  // Channel subsets are only supported for the native pixel format.
+  if (m_channel_mask != kAllChannels &&
+      m_pixel_format != PixelFormat::kNative) {
+    std::cout << "A channel mask requires the native pixel format.\n";
+    return false;
+  }
+  if (m_num_output_channels == 0) {
+    std::cout << "The channel mask selects none of the image channels.\n";
+    return false;
+  }
   return true;
 }
 
-bool Decoder::HasChroma() const {
-  return m_use_ycbcr && m_num_channels >= 3;
+void Decoder::SelectChannels() {
+  // Select the output channels. In luma-only mode, only the first channel is
+  // decoded, and it is already in the output pixel format.
+  const bool luma_only = IsLumaOnly();
+  m_channel_offsets.resize(m_num_channels);
+  m_output_channel_offsets.clear();
+  for (int chan = 0; chan < m_num_channels; ++chan) {
+    bool selected;
+    if (luma_only)
+      selected = chan == 0;
+    else if (chan < 32)
+      selected = ((m_channel_mask >> chan) & 1) != 0;
+    else
+      selected = m_channel_mask == kAllChannels;
+    m_channel_offsets[chan] = selected ? 0 : -1;
+  }
+
+  // Color channels are converted from YCbCr together, so either all of them
+  // or none of them are decoded.
+  const bool with_chroma = HasChroma() && !luma_only;
+  const bool any_color = with_chroma && (m_channel_offsets[0] >= 0 ||
+                                         m_channel_offsets[1] >= 0 ||
+                                         m_channel_offsets[2] >= 0);
+
+  // Assign the position of each decoded channel within a decoded pixel.
+  m_num_decoded_channels = 0;
+  m_num_used_channels = 0;
+  for (int chan = 0; chan < m_num_channels; ++chan) {
+    const bool output = m_channel_offsets[chan] >= 0;
+    if (output || (any_color && chan < 3)) {
+      if (output)
+        m_output_channel_offsets.push_back(m_num_decoded_channels);
+      m_channel_offsets[chan] = m_num_decoded_channels++;
+      m_num_used_channels = chan + 1;
+    }
+  }
+  m_num_output_channels =
+      static_cast<int>(m_output_channel_offsets.size());
 }
 
-bool Decoder::DecodeRIFFStart() {
-  if (m_packed_size < 12)
-    return false;
+bool Decoder::NeedsOutputConversion() const {
+  return (m_pixel_format != PixelFormat::kNative && !IsLumaOnly()) ||
+         m_num_output_channels != m_num_decoded_channels;
+}
 
-  if (m_packed_data[0] != 'R' || m_packed_data[1] != 'I' ||
-      m_packed_data[2] != 'F' || m_packed_data[3] != 'F')
-    return false;
+bool Decoder::NeedsColorConversion() const {
+  // Note: Either all or none of the color channels are decoded.
+  return HasChroma() && m_channel_offsets[1] >= 0 &&
+         m_pixel_format != PixelFormat::kPlanarYCbCr;
+}
+
+void Decoder::StoreOutputRow(uint8_t *out,
+                             int plane_stride,
+                             const uint8_t *in,
+                             int width) const {
+  // Channel subsets are only supported for the native pixel format.
+  if (m_num_output_channels != m_num_decoded_channels) {
+    const int *offsets = m_output_channel_offsets.data();
+    for (int x = 0; x < width; ++x) {
+      for (int chan = 0; chan < m_num_output_channels; ++chan)
+        *out++ = in[offsets[chan]];
+      in += m_num_decoded_channels;
+    }
+    return;
+  }
+
+  PixelFormatConverter::StoreRow(out,
+                                 plane_stride,
+                                 in,
+                                 width,
+                                 m_num_decoded_channels,
+                                 m_pixel_format,
+                                 m_premultiply_alpha);
+}
+
+bool Decoder::SetOutputBuffer(uint8_t *out, int row_stride, bool bottom_up) {
+  // Rows that are delivered to a row sink are not stored.
+  if (m_row_sink) {
+    m_out = nullptr;
+    m_out_row_stride = 0;
+    m_out_plane_stride = 0;
+    return true;
+  }
 
-  int file_size = static_cast<int>(m_packed_data[4]) |
-                  (static_cast<int>(m_packed_data[5]) << 8) |
-                  (static_cast<int>(m_packed_data[6]) << 16) |
-                  (static_cast<int>(m_packed_data[7]) << 24);
-  if (file_size + 8 != m_packed_size)
+  // Unless the caller provided a buffer, we use the internal buffer.
+  const int num_planes =
+      PixelFormatConverter::NumPlanes(m_pixel_format, m_num_channels);
+  if (!out) {
+    row_stride = output_row_size();
+    m_unpacked_data.resize(static_cast<int64_t>(row_stride) *
+                           m_output_height * num_planes);
+    out = m_unpacked_data.data();
+  } else if (row_stride < output_row_size()) {
+    // The rows of a caller-provided buffer must not overlap.
+    std::cout << "Invalid row stride.\n";
     return false;
+  }
+  m_out_plane_stride = m_output_height * row_stride;
+  if (bottom_up) {
+    m_out = out + (m_output_height - 1) * row_stride;
+    m_out_row_stride = -row_stride;
+  } else {
+    m_out = out;
+    m_out_row_stride = row_stride;
+  }
+  return true;
+}
+
+bool Decoder::SetScale(int denominator) {
+  switch (denominator) {
+    case 1:
+      m_scale_shift = 0;
+      return true;
+    case 2:
+      m_scale_shift = 1;
+      return true;
+    case 4:
+      m_scale_shift = 2;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool Decoder::HasChroma() const {
+  return m_use_ycbcr && m_num_channels >= 3;
+}
+
+bool Decoder::IsLumaOnly() const {
+  // The luma is the first channel of grayscale and YCbCr images.
+  return m_pixel_format == PixelFormat::kLuma &&
+         (m_num_channels <= 2 || HasChroma());
+}
 
-  if (m_packed_data[8] != 'H' || m_packed_data[9] != 'I' ||
-      m_packed_data[10] != 'M' || m_packed_data[11] != 'G')
+bool Decoder::DecodeRIFFStart(bool allow_partial_data) {
+  if (!ReadRIFFStart(
+          m_packed_data, m_packed_size, allow_partial_data, &m_riff_size))
     return false;
 
   m_packed_idx += 12;
@@ -173,28 +1131,32 @@ bool Decoder::DecodeHeader() {
   const uint8_t *chunk_data = &m_packed_data[m_packed_idx];
   m_packed_idx += chunk_size;
 
-  // Check the header size.
-  if (chunk_size < 11)
+  ImageInfo info;
+  if (!ReadFormat(chunk_data, chunk_size, &info))
     return false;
 
   // Check version.
-  uint8_t version = chunk_data[0];
-  if (version != 1) {
+  if (!IsSupportedVersion(info.version)) {
     std::cout << "Incorrect HIMG version number.\n";
     return false;
   }
+  m_version = info.version;
 
   // Get image dimensions.
-  m_width = static_cast<int>(chunk_data[1]) |
-            (static_cast<int>(chunk_data[2]) << 8) |
-            (static_cast<int>(chunk_data[3]) << 16) |
-            (static_cast<int>(chunk_data[4]) << 24);
-  m_height = static_cast<int>(chunk_data[5]) |
-             (static_cast<int>(chunk_data[6]) << 8) |
-             (static_cast<int>(chunk_data[7]) << 16) |
-             (static_cast<int>(chunk_data[8]) << 24);
-  m_num_channels = static_cast<int>(chunk_data[9]);
-  m_use_ycbcr = chunk_data[10] != 0;
+  m_width = info.width;
+  m_height = info.height;
+  m_num_channels = info.num_channels;
+  m_use_ycbcr = info.use_ycbcr;
+  SelectChannels();
+
+  // Unless a region is given, the entire image is decoded.
+  const int scale_round = (1 << m_scale_shift) - 1;
+  m_region.x = 0;
+  m_region.y = 0;
+  m_region.width = (m_width + scale_round) >> m_scale_shift;
+  m_region.height = (m_height + scale_round) >> m_scale_shift;
+  m_output_width = m_region.width;
+  m_output_height = m_region.height;
 
   return true;
 }
@@ -218,35 +1180,92 @@ bool Decoder::DecodeLowRes() {
     return false;
 
   // Prepare a buffer for all channels.
-  const int num_rows = (m_height + 7) >> 3;
-  const int num_cols = (m_width + 7) >> 3;
-  const int channel_size =
-      Downsampled::BlockDataSizePerChannel(num_rows, num_cols);
+  const int channel_size = LowResChannelSize();
   const int unpacked_size = channel_size * m_num_channels;
-  std::vector<uint8_t> unpacked_data(unpacked_size);
+  m_low_res_data.resize(unpacked_size);
 
-  // Uncompress source Huffman data.
-  HuffmanDec huffman_dec(m_packed_data + m_packed_idx, chunk_size, 0);
-  if (!huffman_dec.Init() ||
-      !huffman_dec.Uncompress(unpacked_data.data(), unpacked_size)) {
+  // The channels to decode.
+  m_low_res_channels.clear();
+  for (int chan = 0; chan < m_num_used_channels; ++chan) {
+    if (m_channel_offsets[chan] >= 0)
+      m_low_res_channels.push_back(chan);
+  }
+  const int num_channels = static_cast<int>(m_low_res_channels.size());
+
+  // Uncompress source Huffman data. From version 2, each channel is a separate
+  // Huffman block (unless there is only one channel), and the channels are
+  // uncompressed in parallel. Otherwise the channels are stored one after the
+  // other in a single stream, so the data after the last decoded channel is not
+  // decoded.
+  const bool use_blocks = m_version >= 2 && m_num_channels > 1;
+  const int used_size = channel_size * m_num_used_channels;
+  bool ok = m_huffman_dec.Init(m_packed_data + m_packed_idx,
+                               chunk_size,
+                               use_blocks ? channel_size : 0);
+  if (ok && use_blocks) {
+    ok = m_huffman_dec.num_blocks() == m_num_channels;
+    if (ok) {
+      m_low_res_ok = true;
+      auto uncompress_channel = [this](int i, int) {
+        UncompressLowResChannelTask(i);
+      };
+      m_executor->Run(num_channels, uncompress_channel);
+      ok = m_low_res_ok;
+    }
+  } else if (ok && used_size < unpacked_size) {
+    ok = m_huffman_dec.UncompressBlockPrefix(
+        m_low_res_data.data(), used_size, 0);
+  } else if (ok) {
+    ok = m_huffman_dec.Uncompress(m_low_res_data.data(), unpacked_size);
+  }
+  if (!ok) {
     std::cout << "Error: Invalid Huffman data.\n";
     return false;
   }
   m_packed_idx += chunk_size;
 
-  // Initialize the downsampled version of each channel.
-  for (int chan = 0; chan < m_num_channels; ++chan) {
-    m_downsampled.push_back(Downsampled());
-    Downsampled &downsampled = m_downsampled.back();
-    downsampled.SetBlockData(unpacked_data.data() + channel_size * chan,
-                             num_rows,
-                             num_cols,
-                             m_low_res_mapper);
-  }
+  // Initialize the downsampled version of each decoded channel. The macro
+  // block rows of all channels are restored in parallel.
+  const int num_rows = (m_height + 7) >> 3;
+  const int num_cols = (m_width + 7) >> 3;
+  m_downsampled.resize(m_num_channels);
+  for (int chan : m_low_res_channels)
+    m_downsampled[chan].StartBlockData(num_rows, num_cols);
+  auto restore_macro_block_row = [this](int task, int) {
+    RestoreLowResTask(task);
+  };
+  m_executor->Run(num_channels * Downsampled::NumMacroBlockRows(num_rows),
+                  restore_macro_block_row);
 
   return true;
 }
 
+int Decoder::LowResChannelSize() const {
+  const int num_rows = (m_height + 7) >> 3;
+  const int num_cols = (m_width + 7) >> 3;
+  return Downsampled::BlockDataSizePerChannel(num_rows, num_cols);
+}
+
+void Decoder::UncompressLowResChannelTask(int i) {
+  const int chan = m_low_res_channels[i];
+  const int channel_size = LowResChannelSize();
+  if (!m_huffman_dec.UncompressBlock(
+          m_low_res_data.data() + channel_size * chan, channel_size, chan)) {
+    m_low_res_ok = false;
+  }
+}
+
+void Decoder::RestoreLowResTask(int task) {
+  // The tasks are ordered by channel, and then by macro block row.
+  const int num_macro_rows =
+      Downsampled::NumMacroBlockRows((m_height + 7) >> 3);
+  const int chan = m_low_res_channels[task / num_macro_rows];
+  m_downsampled[chan].SetMacroBlockRow(
+      m_low_res_data.data() + LowResChannelSize() * chan,
+      task % num_macro_rows,
+      m_low_res_mapper);
+}
+
 bool Decoder::DecodeQuantizationConfig() {
   // Find the QCFG chunk.
   int chunk_size;
@@ -271,175 +1290,527 @@ bool Decoder::DecodeFullResMappingFunction() {
   return m_full_res_mapper.SetMappingFunction(chunk_data, chunk_size);
 }
 
-bool Decoder::DecodeFullRes() {
+bool Decoder::StartFullRes() {
   // Find the FRES chunk.
   int chunk_size;
   if (!FindRIFFChunk(ToFourcc("FRES"), &chunk_size))
     return false;
 
-  // Reserve space for the output data.
-  m_unpacked_data.resize(m_width * m_height * m_num_channels);
-
   // Prepare uncompression of the Huffman data.
-  const int huffman_block_size = ((m_width + 7) >> 3) * 64 * m_num_channels;
-  HuffmanDec huffman_dec(m_packed_data + m_packed_idx, chunk_size, huffman_block_size);
-  if (!huffman_dec.Init()) {
+  const int huffman_block_size = PrepareFullRes();
+  if (!m_huffman_dec.Init(
+          m_packed_data + m_packed_idx, chunk_size, huffman_block_size)) {
     std::cout << "Error: Invalid Huffman data.\n";
     return false;
   }
   m_packed_idx += chunk_size;
 
-  // Process all the 8x8 blocks, one row at a time or several rows in parallel.
-  {
-    std::atomic_int next_row(0);
-    std::atomic_bool success(true);
-
-    // One worker core lambda is run in each worker thread.
-    auto worker_core = [this, &huffman_dec, &next_row, &success]() {
-      while (true) {
-        int y = next_row.fetch_add(8, std::memory_order_relaxed);
-        if (y >= m_height)
-          break;
-        if (!DecodeFullResBlockRow(huffman_dec, y)) {
-          success = false;
-          break;
-        }
-      }
-    };
+  return true;
+}
 
-    // Start the worker threads (we start N - 1 new threads, and run one worker
-    // in the current thread).
-    int worker_threads = std::min((m_height + 7) / 8, m_max_threads);
-    std::vector<std::thread> threads;
-    for (int i = 0; i < worker_threads - 1; ++i)
-      threads.push_back(std::thread(worker_core));
+int Decoder::PrepareFullRes() {
+  // Prepare the working memory for all workers.
+  const int num_rows = (m_height + 7) >> 3;
+  const int row_data_size = ((m_width + 7) >> 3) * 64 * m_num_channels;
+  const int lowres_band_size =
+      ((m_width + 7) >> 3) * 64 * m_num_decoded_channels;
+  for (auto &scratch : m_worker_scratch) {
+    scratch.full_res_data.resize(row_data_size);
+    scratch.lowres_band.resize(lowres_band_size);
+  }
 
-    // One worker is always run in the current thread.
-    worker_core();
+  // Create an inverse index LUT for reading back the interleaved elements.
+  for (int i = 0; i < 64; ++i)
+    m_deinterleave_index[kIndexLUT[i]] = i * ((m_width + 7) >> 3);
 
-    // Wait for all the worker threads to finish.
-    for (auto &thread : threads)
-      thread.join();
+  m_restore_block_row = SelectRestoreBlockRow();
 
-    if (!success)
-      return false;
+  // There is one Huffman block per block row, unless there is only a single
+  // block row.
+  return num_rows > 1 ? row_data_size : 0;
+}
+
+bool Decoder::DecodeFullResBlockRows(int first_row, int num_rows) {
+  // Process the 8x8 blocks that intersect the decoded region, one row at a time
+  // or several rows in parallel.
+  m_first_block_row = first_row;
+  m_block_rows_ok = true;
+  auto decode_row = [this](int v, int worker) {
+    DecodeFullResBlockRowTask(v, worker);
+  };
+  if (m_row_sink && m_row_sink_ordered &&
+      m_executor != m_thread_pool.get()) {
+    // Ordered delivery relies on the tasks being started in order, which only
+    // the built-in thread pool promises.
+    for (int v = 0; v < num_rows; ++v)
+      decode_row(v, 0);
+  } else {
+    m_executor->Run(num_rows, decode_row);
   }
 
-  return true;
+  return m_block_rows_ok;
+}
+
+void Decoder::DecodeFullResBlockRowTask(int v, int worker) {
+  // Once a block row has failed (or the decoding has been cancelled), the
+  // remaining tasks return right away.
+  if (!m_block_rows_ok)
+    return;
+  if (IsCancelled()) {
+    m_cancelled = true;
+    m_block_rows_ok = false;
+    FailRowSink();
+    return;
+  }
+
+  const int y = BlockRowToOutputY(m_first_block_row + v);
+  if (!DecodeFullResBlockRow(y, m_worker_scratch[worker], false)) {
+    m_block_rows_ok = false;
+    FailRowSink();
+  }
 }
 
-bool Decoder::DecodeFullResBlockRow(const HuffmanDec &huffman_dec, int y) {
+bool Decoder::IsCancelled() const {
+  if (m_cancellation_token && m_cancellation_token->is_cancelled())
+    return true;
+  return m_deadline != TimePoint::max() &&
+         std::chrono::steady_clock::now() >= m_deadline;
+}
+
+void Decoder::DecodePreview() {
+  // The preview is decoded just like the full resolution image, but only the
+  // low-res component of each block is used.
+  auto decode_row = [this](int v, int worker) {
+    DecodeFullResBlockRow(BlockRowToOutputY(v), m_worker_scratch[worker], true);
+  };
+  m_executor->Run(NumBlockRows(), decode_row);
+}
+
+int Decoder::NumBlockRows() const {
+  // Note: The region is given in output pixels, and each block is
+  // 8 >> m_scale_shift output pixels high.
+  const int block_shift = 3 - m_scale_shift;
+  const int first_row = m_region.y >> block_shift;
+  const int end_row =
+      (m_region.y + m_region.height + (1 << block_shift) - 1) >> block_shift;
+  return end_row - first_row;
+}
+
+int Decoder::BlockRowToOutputY(int v) const {
+  // Block rows are counted from the first block row of the region.
+  const int block_shift = 3 - m_scale_shift;
+  return (v + (m_region.y >> block_shift)) << block_shift;
+}
+
+bool Decoder::DecodeFullResBlockRow(int y,
+                                    WorkerScratch &scratch,
+                                    bool preview) {
   // Determine the number of horizontal blocks.
   const int horizontal_blocks = (m_width + 7) >> 3;
 
-  // Vertical block coordinate (v).
-  int v = y >> 3;
-  int block_height = std::min(8, m_height - y);
+  // The size of a block in output pixels (smaller than 8x8 when scaling).
+  const int block_shift = 3 - m_scale_shift;
+  const int block_size = 1 << block_shift;
 
-  // Prepare an unpacked buffer for all channels.
-  int full_res_data_size = horizontal_blocks * m_num_channels * 64;
-  std::vector<uint8_t> full_res_data(full_res_data_size);
+  // Vertical block coordinate (v).
+  int v = y >> block_shift;
+
+  // The rows of this block row that are inside the decoded region.
+  const int y0 = std::max(y, m_region.y);
+  const int y1 = std::min(y + block_size, m_region.y + m_region.height);
+
+  // The blocks of this block row that intersect the decoded region.
+  const int first_u = m_region.x >> block_shift;
+  const int end_u =
+      (m_region.x + m_region.width + block_size - 1) >> block_shift;
+
+  // Only the selected channels are reconstructed (num_channels per pixel).
+  const int num_channels = m_num_decoded_channels;
+  const bool convert = NeedsOutputConversion();
+
+  // Do Huffman decompression of a single block row. The channels are stored
+  // one after the other, so the data after the last decoded channel is never
+  // decoded.
+  uint8_t *full_res_data = scratch.full_res_data.data();
+  int full_res_data_size = horizontal_blocks * m_num_used_channels * 64;
+  if (!preview) {
+    const bool ok = m_num_used_channels < m_num_channels
+                        ? m_huffman_dec.UncompressBlockPrefix(
+                              full_res_data, full_res_data_size, v)
+                        : m_huffman_dec.UncompressBlock(
+                              full_res_data, full_res_data_size, v);
+    if (!ok) {
+      std::cout << "Error: Invalid Huffman data.\n";
+      return false;
+    }
+  }
 
-  // Do Huffman decompression of a single block row.
-  if (!huffman_dec.UncompressBlock(full_res_data.data(), full_res_data_size, v)) {
-    std::cout << "Error: Invalid Huffman data.\n";
-    return false;
+  int16_t *buf1 = scratch.buf1;
+  int16_t *lowres = scratch.lowres;
+
+  // Native pixels are written straight to the output buffer. For other pixel
+  // formats (and for the row sink), the block row is reconstructed in the band
+  // buffer first.
+  const bool use_band = convert || m_row_sink != nullptr;
+  uint8_t *rows = use_band ? scratch.band.data() : OutputRow(y0);
+  const int rows_stride =
+      use_band ? m_region.width * num_channels : m_out_row_stride;
+
+  // The blocks of (up to kChannelGroupSize) channels are reconstructed one
+  // after the other, and are then stored as interleaved pixels in a single
+  // pass. The YCbCr->RGB conversion is done at the same time, so the color
+  // channels are always in the first group.
+  const bool ycbcr = NeedsColorConversion();
+
+  // Get the low-res component of the whole block row for all channels.
+  int16_t *lowres_band = scratch.lowres_band.data();
+  const int lowres_stride = (end_u - first_u) * 8;
+  if (!preview && block_size == 8) {
+    for (int chan = 0; chan < m_num_used_channels; ++chan) {
+      const int chan_offset = m_channel_offsets[chan];
+      if (chan_offset >= 0) {
+        m_downsampled[chan].GetLowresBlockRow(
+            lowres_band + chan_offset * 8 * lowres_stride,
+            lowres_stride,
+            v,
+            first_u,
+            end_u);
+      }
+    }
   }
 
-  int unpacked_idx = 0;
+  if (LIKELY(!preview && m_restore_block_row != nullptr)) {
+    (this->*m_restore_block_row)(full_res_data,
+                                 lowres_band,
+                                 scratch,
+                                 rows,
+                                 rows_stride,
+                                 y,
+                                 y0,
+                                 y1,
+                                 first_u,
+                                 end_u);
+  } else {
+    for (int u = first_u; u < end_u; ++u) {
+      // The columns of this block that are inside the decoded region.
+      const int x = u << block_shift;
+      const int x0 = std::max(x, m_region.x);
+      const int x1 = std::min(x + block_size, m_region.x + m_region.width);
+
+      int group_size = 0;
+      for (int chan = 0; chan < m_num_used_channels; ++chan) {
+        // Skip channels that are not decoded.
+        const int chan_offset = m_channel_offsets[chan];
+        if (chan_offset < 0)
+          continue;
+        const int unpacked_idx = chan * horizontal_blocks * 64;
+
+        // Get the low-res (divided by 8x8) image for this channel.
+        Downsampled &downsampled = m_downsampled[chan];
+
+        bool is_chroma_channel = m_use_ycbcr && (chan == 1 || chan == 2);
+
+        int16_t *block = scratch.blocks[group_size++];
+        uint8_t packed[64];
+        if (UNLIKELY(preview)) {
+          // The preview only consists of the low-res component.
+          if (block_size == 8)
+            downsampled.GetLowresBlock(block, u, v);
+          else
+            downsampled.GetLowresBlockScaled(block, u, v, block_size);
+        } else if (LIKELY(block_size == 8)) {
+          // Get quantized data from the unpacked buffer.
+          // NOTE: This seems to be a bottleneck on x86 (64). The irregular
+          // addressing pattern and two levels of indirection seem to be the
+          // main issues. Loop unrolling (e.g. -funroll-loops) helps to some
+          // extent.
+          const uint8_t *src = &full_res_data[unpacked_idx + u];
+          for (int i = 0; i < 64; ++i)
+            packed[i] = src[m_deinterleave_index[i]];
+
+          // De-quantize.
+          m_quantize.Unpack(buf1, packed, is_chroma_channel, m_full_res_mapper);
+
+          // Inverse transform.
+          Hadamard::Inverse(block, buf1);
+
+          // Add low-res component.
+          const int16_t *lowres_line = lowres_band +
+                                       chan_offset * 8 * lowres_stride +
+                                       (u - first_u) * 8;
+          for (int i = 0; i < 8; ++i) {
+            for (int j = 0; j < 8; ++j)
+              block[i * 8 + j] += lowres_line[j];
+            lowres_line += lowres_stride;
+          }
+        } else if (UNLIKELY((u + 1) * 8 > m_width || (v + 1) * 8 > m_height)) {
+          // The reduced inverse transform would average the padding of blocks
+          // that are partially outside of the image into the edge pixels, so
+          // these blocks are reconstructed at full size, and only the pixels
+          // that are inside of the image are averaged.
+          const uint8_t *src = &full_res_data[unpacked_idx + u];
+          for (int i = 0; i < 64; ++i)
+            packed[i] = src[m_deinterleave_index[i]];
+          m_quantize.Unpack(buf1, packed, is_chroma_channel, m_full_res_mapper);
+          Hadamard::Inverse(block, buf1);
+          downsampled.GetLowresBlock(lowres, u, v);
+          const int valid_width = std::min(m_width - u * 8, 8);
+          const int valid_height = std::min(m_height - v * 8, 8);
+          const int scale = 8 >> block_shift;
+          for (int i = 0; i * scale < valid_height; ++i) {
+            const int end_k = std::min((i + 1) * scale, valid_height);
+            for (int j = 0; j * scale < valid_width; ++j) {
+              const int end_l = std::min((j + 1) * scale, valid_width);
+              int sum = 0;
+              for (int k = i * scale; k < end_k; ++k) {
+                for (int l = j * scale; l < end_l; ++l)
+                  sum += block[k * 8 + l] + lowres[k * 8 + l];
+              }
+              const int count = (end_k - i * scale) * (end_l - j * scale);
+              block[i * 8 + j] = static_cast<int16_t>(
+                  (sum + (sum >= 0 ? count : -count) / 2) / count);
+            }
+          }
+        } else {
+          // When scaling, only the lowest frequency coefficients are used, and
+          // the reduced inverse transform gives the downscaled block directly.
+          const uint8_t *src = &full_res_data[unpacked_idx + u];
+          for (int i = 0; i < block_size; ++i) {
+            for (int j = 0; j < block_size; ++j)
+              packed[i * 8 + j] = src[m_deinterleave_index[i * 8 + j]];
+          }
+          m_quantize.UnpackReduced(
+              buf1, packed, block_size, is_chroma_channel, m_full_res_mapper);
+          Hadamard::InverseReduced(block, buf1, block_size);
+          downsampled.GetLowresBlockScaled(lowres, u, v, block_size);
+          for (int i = 0; i < block_size; ++i) {
+            for (int j = 0; j < block_size; ++j)
+              block[i * 8 + j] += lowres[i * 8 + j];
+          }
+        }
 
-  // Allocate aligned working buffers (enable aligned memory access & SIMD).
-  int16_t *buf0, *buf1, *lowres;
-  static const int kBufferAlignment = 16;
-  std::unique_ptr<int16_t> buffers(new int16_t[3 * 64 + kBufferAlignment - 1]);
-  {
-    intptr_t alignment_adjust =
-        reinterpret_cast<intptr_t>(buffers.get()) & (kBufferAlignment - 1);
-    if (alignment_adjust)
-      alignment_adjust = kBufferAlignment - alignment_adjust;
-    buf1 = reinterpret_cast<int16_t*>(
-        ASSUME_ALIGNED16(buffers.get() + alignment_adjust));
-    buf0 = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(buf1 + 64));
-    lowres = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(buf0 + 64));
+        // Store the pixels of the group when it is full (or complete).
+        if (group_size == kChannelGroupSize ||
+            chan_offset == num_channels - 1) {
+          const int group_offset = chan_offset + 1 - group_size;
+          RestorePixelBlock(
+              rows + (x0 - m_region.x) * num_channels + group_offset,
+              &scratch.blocks[0][(y0 - y) * 8 + (x0 - x)],
+              group_size,
+              num_channels,
+              rows_stride,
+              x1 - x0,
+              y1 - y0,
+              ycbcr && group_offset == 0);
+          group_size = 0;
+        }
+      }
+    }
   }
 
-  // All channels are inteleaved per block row.
-  for (int chan = 0; chan < m_num_channels; ++chan) {
-    // Get the low-res (divided by 8x8) image for this channel.
-    Downsampled &downsampled = m_downsampled[chan];
+  // Convert the block row to the output pixel format while it is in the cache.
+  if (m_row_sink) {
+    DeliverRows(y0, y1, rows, convert, scratch);
+  } else if (convert) {
+    for (int i = 0; i < y1 - y0; ++i) {
+      StoreOutputRow(OutputRow(y0 + i),
+                     m_out_plane_stride,
+                     rows + i * rows_stride,
+                     m_region.width);
+    }
+  }
+
+  // Tell the progress listener that these rows are done.
+  if (!preview && m_progress_listener)
+    m_progress_listener->OnRowsDecoded(y0 - m_region.y, y1 - y0);
 
-    // Create an inverse index LUT for reading back the interleaved elements.
-    int deinterleave_index[64];
-    for (int i = 0; i < 64; ++i)
-      deinterleave_index[kIndexLUT[i]] = i * horizontal_blocks;
+  return true;
+}
+
+template <int N, bool CHROMA, bool YCBCR>
+void Decoder::RestoreBlockRow(const uint8_t *full_res_data,
+                              const int16_t *lowres_band,
+                              WorkerScratch &scratch,
+                              uint8_t *rows,
+                              int rows_stride,
+                              int y,
+                              int y0,
+                              int y1,
+                              int first_u,
+                              int end_u) {
+  const int horizontal_blocks = (m_width + 7) >> 3;
+  const int lowres_stride = (end_u - first_u) * 8;
+  int16_t *blocks = scratch.blocks[0];
 
-    bool is_chroma_channel = m_use_ycbcr && (chan == 1 || chan == 2);
+  for (int u = first_u; u < end_u; ++u) {
+    // The columns of this block that are inside the decoded region.
+    const int x = u << 3;
+    const int x0 = std::max(x, m_region.x);
+    const int x1 = std::min(x + 8, m_region.x + m_region.width);
 
-    for (int x = 0; x < m_width; x += 8) {
-      // Horizontal block coordinate (u).
-      int u = x >> 3;
-      int block_width = std::min(8, m_width - x);
+    // Reconstruct the blocks of all the channels (the loop is unrolled, so the
+    // chroma selection is resolved at compile time).
+    for (int chan = 0; chan < N; ++chan) {
+      int16_t *block = blocks + chan * 64;
 
       // Get quantized data from the unpacked buffer.
-      // NOTE: This seems to be a bottleneck on x86 (64). The irregular
-      // addressing pattern and two levels of indirection seem to be the main
-      // issues. Loop unrolling (e.g. -funroll-loops) helps to some extent.
+      const uint8_t *src = &full_res_data[chan * horizontal_blocks * 64 + u];
       uint8_t packed[64];
-      {
-        const uint8_t *src = &full_res_data[unpacked_idx + u];
-        for (int i = 0; i < 64; ++i)
-          packed[i] = src[deinterleave_index[i]];
-      }
+      for (int i = 0; i < 64; ++i)
+        packed[i] = src[m_deinterleave_index[i]];
 
       // De-quantize.
-      m_quantize.Unpack(buf1, packed, is_chroma_channel, m_full_res_mapper);
+      m_quantize.Unpack(scratch.buf1,
+                        packed,
+                        CHROMA && (chan == 1 || chan == 2),
+                        m_full_res_mapper);
 
       // Inverse transform.
-      Hadamard::Inverse(buf0, buf1);
+      Hadamard::Inverse(block, scratch.buf1);
 
       // Add low-res component.
-      downsampled.GetLowresBlock(lowres, u, v);
-      for (int i = 0; i < 64; ++i) {
-        buf0[i] += lowres[i];
+      const int16_t *lowres_line =
+          lowres_band + chan * 8 * lowres_stride + (u - first_u) * 8;
+      for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j)
+          block[i * 8 + j] += lowres_line[j];
+        lowres_line += lowres_stride;
       }
+    }
 
-      // Copy color channel to destination data.
-      RestoreChannelBlock(
-          &m_unpacked_data[(y * m_width + x) * m_num_channels + chan],
-          buf0,
-          m_num_channels,
-          m_width * m_num_channels,
-          block_width,
-          block_height);
+    // Store the pixels of all the channels.
+    uint8_t *out = rows + (x0 - m_region.x) * N;
+    const int16_t *in = blocks + (y0 - y) * 8 + (x0 - x);
+#if defined(__SSE2__)
+    if (LIKELY(x1 - x0 == 8)) {
+      RestorePixelBlockSIMD<N>(out, in, rows_stride, y1 - y0, YCBCR);
+      continue;
     }
+#endif
+    RestorePixelBlock(out, in, N, N, rows_stride, x1 - x0, y1 - y0, YCBCR);
+  }
+}
 
-    unpacked_idx += horizontal_blocks * 64;
+Decoder::RestoreBlockRowFunc Decoder::SelectRestoreBlockRow() const {
+  // The specialized code is only used for full size blocks, when all the
+  // channels up to the last decoded channel are decoded (i.e. each channel is
+  // at its own position in a decoded pixel).
+  if (m_scale_shift != 0 || m_num_decoded_channels != m_num_used_channels)
+    return nullptr;
+
+  // Note: Chroma channels (YCbCr) are only present with three channels or
+  // more, and can only be converted to RGB if they are decoded.
+  const bool chroma = HasChroma();
+  const bool ycbcr = NeedsColorConversion();
+  switch (m_num_decoded_channels) {
+    case 1:
+      return &Decoder::RestoreBlockRow<1, false, false>;
+    case 2:
+      return &Decoder::RestoreBlockRow<2, false, false>;
+    case 3:
+      if (ycbcr)
+        return &Decoder::RestoreBlockRow<3, true, true>;
+      return chroma ? &Decoder::RestoreBlockRow<3, true, false>
+                    : &Decoder::RestoreBlockRow<3, false, false>;
+    case 4:
+      if (ycbcr)
+        return &Decoder::RestoreBlockRow<4, true, true>;
+      return chroma ? &Decoder::RestoreBlockRow<4, true, false>
+                    : &Decoder::RestoreBlockRow<4, false, false>;
+    default:
+      return nullptr;
   }
+}
 
-  // Do YCbCr->RGB conversion for this block row if necessary.
-  if (HasChroma()) {
-    uint8_t *buf = &m_unpacked_data[y * m_width * m_num_channels];
-    YCbCr::YCbCrToRGB(buf, m_width, block_height, m_num_channels);
+void Decoder::DeliverRows(int y0,
+                          int y1,
+                          const uint8_t *rows,
+                          bool convert,
+                          WorkerScratch &scratch) {
+  // Convert the rows to the output pixel format.
+  int num_rows = y1 - y0;
+  const int row_size = output_row_size();
+  const uint8_t *data = rows;
+  if (convert) {
+    uint8_t *out = scratch.sink_band.data();
+    const int rows_stride = m_region.width * m_num_decoded_channels;
+    for (int i = 0; i < num_rows; ++i) {
+      StoreOutputRow(out + i * row_size,
+                     num_rows * row_size,
+                     rows + i * rows_stride,
+                     m_region.width);
+    }
+    data = out;
   }
 
-  return true;
-}
+  if (!m_row_sink_ordered) {
+    m_row_sink->OnRows(y0 - m_region.y, num_rows, data, row_size);
+    return;
+  }
 
-bool Decoder::DecodeRIFFChunk(uint32_t *fourcc, int *size) {
-  if ((m_packed_idx + 8) > m_packed_size)
-    return false;
+  // A band that is done before the bands above it is copied to the reorder
+  // window, and is delivered by the worker that delivers the band above it.
+  // When the window is full, the worker waits for the bands above (which are
+  // being decoded, since the tasks are started in order).
+  const int block_row = y0 >> (3 - m_scale_shift);
+  const int window_size = static_cast<int>(m_row_sink_window_rows.size());
+  std::unique_lock<std::mutex> lock(m_row_sink_mutex);
+  if (block_row != m_row_sink_next_row) {
+    m_row_sink_cond.wait(lock, [this, block_row, window_size] {
+      return m_row_sink_failed ||
+             block_row - m_row_sink_next_row < window_size;
+    });
+    if (m_row_sink_failed)
+      return;
+
+    // The band is copied without holding the lock, since no other band is
+    // stored at the same place while this band is in the window.
+    const int band = block_row % window_size;
+    uint8_t *band_data = &m_row_sink_window[band * 8 * m_row_sink_row_size];
+    lock.unlock();
+    std::copy(data, data + num_rows * m_row_sink_row_size, band_data);
+    lock.lock();
+    m_row_sink_window_rows[band] = std::make_pair(block_row, num_rows);
+    if (block_row != m_row_sink_next_row)
+      return;
+
+    // The bands above were delivered while the band was copied.
+    m_row_sink_window_rows[band].second = 0;
+    data = band_data;
+  }
 
-  *fourcc = static_cast<uint32_t>(m_packed_data[m_packed_idx]) |
-            (static_cast<uint32_t>(m_packed_data[m_packed_idx + 1]) << 8) |
-            (static_cast<uint32_t>(m_packed_data[m_packed_idx + 2]) << 16) |
-            (static_cast<uint32_t>(m_packed_data[m_packed_idx + 3]) << 24);
-  *size = static_cast<int>(m_packed_data[m_packed_idx + 4]) |
-          (static_cast<int>(m_packed_data[m_packed_idx + 5]) << 8) |
-          (static_cast<int>(m_packed_data[m_packed_idx + 6]) << 16) |
-          (static_cast<int>(m_packed_data[m_packed_idx + 7]) << 24);
+  // Deliver this band, and the bands below it that are in the window.
+  int first_row = y0 - m_region.y;
+  while (true) {
+    lock.unlock();
+    m_row_sink->OnRows(first_row, num_rows, data, row_size);
+    lock.lock();
+    first_row += num_rows;
+    ++m_row_sink_next_row;
+    const int band = m_row_sink_next_row % window_size;
+    if (m_row_sink_window_rows[band].second == 0 ||
+        m_row_sink_window_rows[band].first != m_row_sink_next_row)
+      break;
+    num_rows = m_row_sink_window_rows[band].second;
+    m_row_sink_window_rows[band].second = 0;
+    data = &m_row_sink_window[band * 8 * m_row_sink_row_size];
+  }
+  lock.unlock();
+  m_row_sink_cond.notify_all();
+}
 
-  m_packed_idx += 8;
-  return m_packed_idx + *size <= m_packed_size;
+void Decoder::FailRowSink() {
+  // Release the workers that wait for room in the reorder window.
+  {
+    std::lock_guard<std::mutex> lock(m_row_sink_mutex);
+    m_row_sink_failed = true;
+  }
+  m_row_sink_cond.notify_all();
+}
+
+bool Decoder::DecodeRIFFChunk(uint32_t *fourcc, int *size) {
+  return ReadRIFFChunk(
+      m_packed_data, m_packed_size, &m_packed_idx, fourcc, size);
 }
 
 bool Decoder::FindRIFFChunk(uint32_t fourcc, int *size) {
@@ -9,22 +9,251 @@
 #ifndef DECODER_H_
 #define DECODER_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 
+#include "cancellation_token.h"
 #include "downsampled.h"
+#include "executor.h"
 #include "huffman_dec.h"
 #include "mapper.h"
+#include "pixel_format.h"
+#include "progress_listener.h"
 #include "quantize.h"
+#include "row_sink.h"
+#include "thread_pool.h"
 
 namespace himg {
 
 class Decoder {
  public:
-  Decoder(int max_threads = 0);
+  // A function that is called when an asynchronous decoding has finished.
+  typedef std::function<void(bool success)> DoneCallback;
 
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  // A channel mask that selects all channels (see SetChannelMask()).
+  static const uint32_t kAllChannels = 0xffffffff;
+
+  // Information about an image (see Probe()).
+  struct ImageInfo {
+    // The position of the data of a chunk, counted from the start of the
+    // packed data (offset and size are 0 if the chunk is not in the data).
+    struct ChunkLocation {
+      int offset;
+      int size;
+    };
+
+    int version;
+    int width;
+    int height;
+    int num_channels;
+    bool use_ycbcr;
+
+    ChunkLocation format;
+    ChunkLocation low_res_mapping;
+    ChunkLocation low_res;
+    ChunkLocation quantization;
+    ChunkLocation full_res_mapping;
+    ChunkLocation full_res;
+  };
+
+  // An image to decode with DecodeBatch(). The output buffer must be provided
+  // by the caller (see Decode() for the buffer layout).
+  struct BatchImage {
+    const uint8_t *packed_data;
+    int packed_size;
+    uint8_t *out;
+    int row_stride;
+    bool bottom_up;
+
+    // Set by DecodeBatch(): true if the image was decoded successfully.
+    bool success;
+  };
+
+  // The decoder keeps a pool of max_threads worker threads (0 = one thread per
+  // hardware thread) for its entire lifetime.
+  Decoder(int max_threads = 0,
+          const ThreadPool::Config &pool_config = ThreadPool::Config());
+
+  // Run all parallel work on an external executor (not owned by the decoder).
+  explicit Decoder(Executor *executor);
+
+  // Decode an image into the internal buffer (see unpacked_data()).
   bool Decode(const uint8_t *packed_data, int packed_size);
 
+  // Decode an image into a caller-provided buffer. The buffer must hold
+  // height() rows of output_row_size() bytes, row_stride bytes apart (for
+  // planar formats, each plane is height() * row_stride bytes), so row_stride
+  // must be at least output_row_size(). If bottom_up is true, the last row of
+  // the image is stored first.
+  bool Decode(const uint8_t *packed_data,
+              int packed_size,
+              uint8_t *out,
+              int row_stride,
+              bool bottom_up);
+
+  // Decode an image asynchronously (out = nullptr for the internal buffer, see
+  // Decode() for the buffer layout). The header and low resolution data are
+  // decoded before the function returns, and the block rows are then decoded
+  // by the executor, after which on_done is called (from any thread). If the
+  // image can not be decoded, on_done is called with false right away. The
+  // decoder, the packed data and the output buffer must be left alone until
+  // on_done has been called.
+  void DecodeAsync(const uint8_t *packed_data,
+                   int packed_size,
+                   uint8_t *out,
+                   int row_stride,
+                   bool bottom_up,
+                   const DoneCallback &on_done);
+
+  // Same as above, but the result is delivered through a future.
+  std::future<bool> DecodeAsync(const uint8_t *packed_data,
+                                int packed_size,
+                                uint8_t *out,
+                                int row_stride,
+                                bool bottom_up);
+
+  // Decode a rectangular region of an image into the internal buffer. Only the
+  // blocks that intersect the region are decoded, and the result is a tightly
+  // packed image of the region (see output_width() and output_height()).
+  bool DecodeRegion(const uint8_t *packed_data,
+                    int packed_size,
+                    int x,
+                    int y,
+                    int width,
+                    int height);
+
+  // Decode a rectangular region of an image into a caller-provided buffer (see
+  // Decode() for the buffer layout, but with the dimensions of the region).
+  bool DecodeRegion(const uint8_t *packed_data,
+                    int packed_size,
+                    int x,
+                    int y,
+                    int width,
+                    int height,
+                    uint8_t *out,
+                    int row_stride,
+                    bool bottom_up);
+
+  // Decode a 1/8 scale thumbnail of an image into the internal buffer. Only
+  // the low resolution data is decoded, so packed_data may be a prefix of the
+  // file (as long as it includes the LRES chunk). Each thumbnail pixel is the
+  // low resolution sample of an 8x8 block. If smooth is true, the samples are
+  // bilinearly interpolated at the centers of the blocks instead.
+  bool DecodeThumbnail(const uint8_t *packed_data,
+                       int packed_size,
+                       bool smooth);
+
+  // Decode a thumbnail into a caller-provided buffer (see Decode() for the
+  // buffer layout, but with the dimensions of the thumbnail).
+  bool DecodeThumbnail(const uint8_t *packed_data,
+                       int packed_size,
+                       bool smooth,
+                       uint8_t *out,
+                       int row_stride,
+                       bool bottom_up);
+
+  // Decode a batch of images, with the current pixel format, scale and channel
+  // mask. Large images are decoded first, one at a time with the block rows in
+  // parallel, and then the small images are decoded as whole-image tasks in
+  // parallel (each worker has a decoder of its own for the state of its
+  // current image). Progress listeners and row sinks are not used. Returns
+  // true if all the images were decoded successfully.
+  bool DecodeBatch(BatchImage *images, int num_images);
+
+  // Read the image information (width() etc) without decoding the image. The
+  // packed data may be a prefix of the file (as long as it includes the FRMT
+  // chunk).
+  bool DecodeInfo(const uint8_t *packed_data, int packed_size);
+
+  // Incremental decoding of an image whose packed data arrives in pieces (e.g.
+  // from a network stream). Begin() starts a new image, Feed() hands over the
+  // next piece of packed data, and Finish() checks that the complete image has
+  // been decoded. Block rows are decoded as soon as their data has arrived (and
+  // reported to the progress listener, if any). The entire image is decoded,
+  // and the output buffer is the same as for Decode() (nullptr = the internal
+  // buffer). Feed() and Finish() return false if the data is invalid.
+  void Begin(uint8_t *out = nullptr,
+             int row_stride = 0,
+             bool bottom_up = false);
+  bool Feed(const uint8_t *data, int size);
+  bool Finish();
+
+  // Get the image information and the locations of the chunks of an image,
+  // without decoding it and without a decoder instance. The packed data may be
+  // a prefix of the file (as long as it includes the FRMT chunk), in which case
+  // only the chunks that are complete within the prefix are located. Nothing
+  // is allocated, and no messages are printed.
+  static bool Probe(const uint8_t *packed_data,
+                    int packed_size,
+                    ImageInfo *info);
+
+  // Select the pixel format of the decoded image (default: kNative). If
+  // premultiply_alpha is true, color is premultiplied by alpha for the RGBA
+  // and BGRA formats.
+  void SetPixelFormat(PixelFormat format, bool premultiply_alpha = false) {
+    m_pixel_format = format;
+    m_premultiply_alpha = premultiply_alpha;
+  }
+
+  // Select the scale of the decoded image: 1 (default), 2 or 4 gives an image
+  // of 1/1, 1/2 or 1/4 of the full size (rounded up). Scaled images are decoded
+  // with a reduced inverse transform, and regions are given in the coordinates
+  // of the scaled image. Returns false for unsupported scales.
+  bool SetScale(int denominator);
+
+  // Select the channels to decode (bit N selects channel N, and channels from
+  // 32 and up are only decoded with kAllChannels). The output only has the
+  // selected channels, e.g. 0x8 gives the alpha channel of an RGBA image. The
+  // selected channels are all that is reconstructed, except that YCbCr color
+  // channels are decoded together. Channel subsets require the native pixel
+  // format.
+  void SetChannelMask(uint32_t mask) { m_channel_mask = mask; }
+
+  // Set a listener that is notified as the decoding of an image progresses
+  // (nullptr = no listener). The listener is not owned by the decoder.
+  void SetProgressListener(ProgressListener *listener) {
+    m_progress_listener = listener;
+  }
+
+  // Deliver the decoded rows of images (and thumbnails) to a row sink instead
+  // of storing them in an output buffer (nullptr = no sink). Only a few bands
+  // of rows per worker are kept in memory, and no preview is drawn. If ordered
+  // is true, the bands are delivered from the top of the image and down, one
+  // at a time. Otherwise they are delivered in any order, possibly from
+  // several threads at once. The sink is not owned by the decoder.
+  //
+  // Note: Ordered delivery is only done in parallel with the built-in thread
+  // pool (which starts the tasks of a job in order). With other executors, the
+  // block rows are decoded one at a time.
+  void SetRowSink(RowSink *sink, bool ordered = true) {
+    m_row_sink = sink;
+    m_row_sink_ordered = ordered;
+  }
+
+  // Abort the decoding of full resolution images when the token is cancelled
+  // (nullptr = no token) or at the deadline (TimePoint::max() = no deadline).
+  // Both are checked before each block row is decoded, so the workers are
+  // released within the time of one block row. The token is not owned by the
+  // decoder.
+  void SetCancellationToken(const CancellationToken *token) {
+    m_cancellation_token = token;
+  }
+  void SetDeadline(TimePoint deadline) { m_deadline = deadline; }
+
+  // True if the last decoding was aborted by the cancellation token or the
+  // deadline.
+  bool cancelled() const { return m_cancelled; }
+
   const uint8_t *unpacked_data() const { return m_unpacked_data.data(); }
   int unpacked_size() const { return static_cast<int>(m_unpacked_data.size()); }
 
@@ -32,34 +261,280 @@ class Decoder {
   int height() const { return m_height; }
   int num_channels() const { return m_num_channels; }
 
+  // The number of channels in the decoded output (see SetChannelMask()).
+  int output_num_channels() const { return m_num_output_channels; }
+  PixelFormat pixel_format() const { return m_pixel_format; }
+
+  // The dimensions of the decoded output (i.e. of the region for
+  // DecodeRegion(), of the thumbnail for DecodeThumbnail(), and of the entire
+  // image otherwise).
+  int output_width() const { return m_output_width; }
+  int output_height() const { return m_output_height; }
+
+  // The number of bytes per output row in the selected pixel format.
+  int output_row_size() const {
+    return m_output_width * PixelFormatConverter::BytesPerPixel(
+                                m_pixel_format, m_num_output_channels);
+  }
+
  private:
   bool HasChroma() const;
+  bool IsLumaOnly() const;
+  struct Rect {
+    int x;
+    int y;
+    int width;
+    int height;
+  };
+
+  // The chunks of a HIMG file, in the order that they are decoded.
+  enum Chunk {
+    kFormatChunk,
+    kLowResMappingChunk,
+    kLowResChunk,
+    kQuantizationChunk,
+    kFullResMappingChunk,
+    kFullResChunk
+  };
+
+  // The state of incremental decoding.
+  enum class StreamState { kRIFFStart, kChunks, kFullRes, kDone, kFailed };
 
-  bool DecodeRIFFStart();
+  // Get the output row that corresponds to the image row y.
+  uint8_t *OutputRow(int y) const {
+    return m_out + (y - m_region.y) * m_out_row_stride;
+  }
+
+  bool DecodeStart(const uint8_t *packed_data,
+                   int packed_size,
+                   bool allow_partial_data);
+  bool DecodeImage(const uint8_t *packed_data,
+                   int packed_size,
+                   const Rect *region,
+                   uint8_t *out,
+                   int row_stride,
+                   bool bottom_up);
+  bool DecodeImageStart(const uint8_t *packed_data,
+                        int packed_size,
+                        const Rect *region,
+                        uint8_t *out,
+                        int row_stride,
+                        bool bottom_up);
+  bool DecodeThumbnailImage(const uint8_t *packed_data,
+                            int packed_size,
+                            bool smooth,
+                            uint8_t *out,
+                            int row_stride,
+                            bool bottom_up);
+  bool PrepareOutput(const Rect *region,
+                     uint8_t *out,
+                     int row_stride,
+                     bool bottom_up);
+  bool DecodeChunk(Chunk chunk);
+  bool DecodeAvailableData();
+  bool DecodeAvailableChunks();
+  bool DecodeAvailableFullRes();
+  bool CheckPixelFormat() const;
+  void SelectChannels();
+  bool NeedsOutputConversion() const;
+  bool NeedsColorConversion() const;
+  void StoreOutputRow(uint8_t *out,
+                      int plane_stride,
+                      const uint8_t *in,
+                      int width) const;
+  bool SetOutputBuffer(uint8_t *out, int row_stride, bool bottom_up);
+
+  bool DecodeRIFFStart(bool allow_partial_data);
   bool DecodeHeader();
   bool DecodeLowResMappingFunction();
   bool DecodeLowRes();
+  int LowResChannelSize() const;
+  void UncompressLowResChannelTask(int i);
+  void RestoreLowResTask(int task);
   bool DecodeQuantizationConfig();
   bool DecodeFullResMappingFunction();
-  bool DecodeFullRes();
+  bool StartFullRes();
+
+  // The number of channels that are reconstructed together, one block at a
+  // time, before being stored as interleaved pixels.
+  static const int kChannelGroupSize = 4;
+
+  // Per-worker working memory, which is kept between calls to Decode().
+  struct WorkerScratch {
+    std::vector<uint8_t> full_res_data;
+
+    // One block row of pixels in the native pixel format (only used for
+    // other output pixel formats, or with a row sink).
+    std::vector<uint8_t> band;
+
+    // One block row of pixels in the output pixel format (only used for other
+    // pixel formats than the native one with a row sink).
+    std::vector<uint8_t> sink_band;
+
+    // The low-res component of one block row, for all decoded channels.
+    std::vector<int16_t> lowres_band;
+
+    // Aligned working buffers (enable aligned memory access & SIMD).
+    alignas(16) int16_t blocks[kChannelGroupSize][64];
+    alignas(16) int16_t buf1[64];
+    alignas(16) int16_t lowres[64];
+  };
+
+  void DecodePreview();
+  int NumBlockRows() const;
+  int BlockRowToOutputY(int v) const;
+  int PrepareFullRes();
+  bool DecodeFullResBlockRows(int first_row, int num_rows);
+  void DecodeFullResBlockRowTask(int v, int worker);
+  bool IsCancelled() const;
+  bool DecodeFullResBlockRow(int y, WorkerScratch &scratch, bool preview);
+
+  // Reconstruct the full size blocks first_u to end_u - 1 of a block row
+  // (rows y0 to y1 - 1 of it), when all the first N channels are decoded.
+  // This is specialized for the channel count and the color space, and is
+  // selected by PrepareFullRes().
+  typedef void (Decoder::*RestoreBlockRowFunc)(const uint8_t *full_res_data,
+                                               const int16_t *lowres_band,
+                                               WorkerScratch &scratch,
+                                               uint8_t *rows,
+                                               int rows_stride,
+                                               int y,
+                                               int y0,
+                                               int y1,
+                                               int first_u,
+                                               int end_u);
+  template <int N, bool CHROMA, bool YCBCR>
+  void RestoreBlockRow(const uint8_t *full_res_data,
+                       const int16_t *lowres_band,
+                       WorkerScratch &scratch,
+                       uint8_t *rows,
+                       int rows_stride,
+                       int y,
+                       int y0,
+                       int y1,
+                       int first_u,
+                       int end_u);
+  RestoreBlockRowFunc SelectRestoreBlockRow() const;
 
-  bool DecodeFullResBlockRow(const HuffmanDec &huffman_dec, int y);
+  void DeliverRows(int y0,
+                   int y1,
+                   const uint8_t *rows,
+                   bool convert,
+                   WorkerScratch &scratch);
+  void FailRowSink();
+
+  bool IsLargeBatchImage(const BatchImage &image) const;
 
   bool DecodeRIFFChunk(uint32_t *fourcc, int *size);
   bool FindRIFFChunk(uint32_t fourcc, int *size);
 
-  int m_max_threads;
+  std::unique_ptr<ThreadPool> m_thread_pool;
+  Executor *m_executor;
 
   Quantize m_quantize;
   LowResMapper m_low_res_mapper;
   FullResMapper m_full_res_mapper;
+  HuffmanDec m_huffman_dec;
   std::vector<Downsampled> m_downsampled;
+  std::vector<uint8_t> m_low_res_data;
+
+  // The channels whose low-res data is decoded, and whether the parallel
+  // low-res decoding succeeded.
+  std::vector<int> m_low_res_channels;
+  std::atomic_bool m_low_res_ok;
+  std::vector<WorkerScratch> m_worker_scratch;
   std::vector<uint8_t> m_unpacked_data;
 
+  // Batch decoding: one single-threaded decoder per worker, and the indices of
+  // the images that are decoded as whole-image tasks.
+  std::vector<std::unique_ptr<Decoder>> m_batch_decoders;
+  std::vector<int> m_batch_small_images;
+
+  // The part of the image to decode (in output pixels), and the dimensions of
+  // the output.
+  Rect m_region;
+  int m_output_width;
+  int m_output_height;
+
+  // The output buffer (the first output row and the distance between rows and
+  // planes).
+  uint8_t *m_out;
+  int m_out_row_stride;
+  int m_out_plane_stride;
+
+  PixelFormat m_pixel_format;
+  bool m_premultiply_alpha;
+  int m_scale_shift;
+  ProgressListener *m_progress_listener;
+  RowSink *m_row_sink;
+  bool m_row_sink_ordered;
+  uint32_t m_channel_mask;
+
+  // The channels to decode: m_channel_offsets[chan] is the position of chan in
+  // a decoded pixel (-1 if it is not decoded), and m_output_channel_offsets
+  // holds the positions of the output channels in a decoded pixel. Only the
+  // first m_num_used_channels channels of the image are decoded.
+  std::vector<int> m_channel_offsets;
+  std::vector<int> m_output_channel_offsets;
+  int m_num_decoded_channels;
+  int m_num_output_channels;
+  int m_num_used_channels;
+
+  // Ordered delivery to the row sink: the next block row to deliver, and a
+  // reorder window of kRowSinkWindowSize bands per worker for the block rows
+  // below it that are already done (band i of the window holds block row
+  // m_row_sink_window_rows[i].first, if its number of rows is non-zero). A row
+  // of a band is m_row_sink_row_size bytes (for all planes). Also whether a
+  // block row has failed (so that the rows below it never come). The members
+  // are protected by m_row_sink_mutex.
+  static const int kRowSinkWindowSize = 2;
+  std::mutex m_row_sink_mutex;
+  std::condition_variable m_row_sink_cond;
+  int m_row_sink_next_row;
+  int m_row_sink_row_size;
+  std::vector<uint8_t> m_row_sink_window;
+  std::vector<std::pair<int, int>> m_row_sink_window_rows;
+  std::atomic_bool m_row_sink_failed;
+
   const uint8_t *m_packed_data;
   int m_packed_size;
   int m_packed_idx;
 
+  // The size of the RIFF data (including the RIFF header).
+  int m_riff_size;
+
+  // The first block row of the current call to DecodeFullResBlockRows() (or of
+  // the current asynchronous decoding), and whether all its rows succeeded.
+  int m_first_block_row;
+  std::atomic_bool m_block_rows_ok;
+
+  // The specialized block row reconstruction (or null, for the generic code),
+  // and the offsets of the 64 coefficients of a block in a block row of
+  // unpacked full resolution data (both are set up by PrepareFullRes()).
+  RestoreBlockRowFunc m_restore_block_row;
+  int m_deinterleave_index[64];
+
+  // Cancellation, and the completion function of an asynchronous decoding.
+  const CancellationToken *m_cancellation_token;
+  TimePoint m_deadline;
+  std::atomic_bool m_cancelled;
+  DoneCallback m_async_done;
+
+  // Incremental decoding (see Begin()). The packed data is collected in
+  // m_stream_data, and m_stream_chunk is the next chunk to decode.
+  StreamState m_stream_state;
+  std::vector<uint8_t> m_stream_data;
+  int m_stream_chunk;
+  int m_stream_fres_idx;
+  int m_stream_fres_size;
+  int m_stream_huffman_block_size;
+  bool m_stream_huffman_ready;
+  int m_stream_rows_done;
+  uint8_t *m_stream_out;
+  int m_stream_row_stride;
+  bool m_stream_bottom_up;
+
+  int m_version;
   int m_width;
   int m_height;
   int m_num_channels;
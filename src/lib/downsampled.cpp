@@ -10,6 +10,10 @@
 
 #include <algorithm>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace himg {
 
 namespace {
@@ -38,7 +42,10 @@ int DecodePredictor(uint8_t encoded_predictor) {
   return static_cast<int>(encoded_predictor + 2);
 }
 
-int16_t PredictSample(int16_t s1, int16_t s2, int16_t s3, int predictor) {
+inline int16_t PredictSample(int16_t s1,
+                             int16_t s2,
+                             int16_t s3,
+                             int predictor) {
   switch (predictor) {
     default:
     case 0:
@@ -59,71 +66,14 @@ int16_t PredictSample(int16_t s1, int16_t s2, int16_t s3, int predictor) {
   }
 }
 
-}  // namespace
-
-Downsampled::Downsampled() : m_rows(0), m_columns(0) {
-}
-
-void Downsampled::SampleImage(const uint8_t *pixels,
-                              int stride,
-                              int width,
-                              int height) {
-  // Divide by 8x8, rounding up.
-  m_rows = (height + 7) >> 3;
-  m_columns = (width + 7) >> 3;
-
-  // Calculate average color for each 8x8 block.
-  std::vector<uint8_t> average;
-  average.reserve(m_rows * m_columns);
-  for (int v = 0; v < m_rows; ++v) {
-    int y_min = std::max(0, v * 8 - 3);
-    int y_max = std::min(height - 1, v * 8 + 4);
-    for (int u = 0; u < m_columns; ++u) {
-      int x_min = std::max(0, u * 8 - 3);
-      int x_max = std::min(width - 1, u * 8 + 4);
-      uint16_t sum = 0;
-      for (int y = y_min; y <= y_max; ++y) {
-        for (int x = x_min; x <= x_max; ++x) {
-          sum += pixels[(y * width + x) * stride];
-        }
-      }
-      int total_count = (x_max - x_min + 1) * (y_max - y_min + 1);
-      average.push_back(
-          static_cast<uint8_t>((sum + (total_count >> 1)) / total_count));
-    }
-  }
-
-  // Compensate blocks for lienear interpolation (phase shift 1/16 pixels up &
-  // to the left).
-  m_data.reserve(m_columns * m_rows);
-  for (int v = 0; v < m_rows; ++v) {
-    int row1 = std::max(0, v - 1);
-    int row2 = v;
-    for (int u = 0; u < m_columns; ++u) {
-      int col1 = std::max(0, u - 1);
-      int col2 = u;
-      uint16_t x11 = static_cast<uint16_t>(average[row1 * m_columns + col1]);
-      uint16_t x12 = static_cast<uint16_t>(average[row1 * m_columns + col2]);
-      uint16_t x21 = static_cast<uint16_t>(average[row2 * m_columns + col1]);
-      uint16_t x22 = static_cast<uint16_t>(average[row2 * m_columns + col2]);
-      uint16_t a1 = (1 * x11 + 15 * x12 + 8) >> 4;
-      uint16_t a2 = (1 * x21 + 15 * x22 + 8) >> 4;
-      m_data.push_back(static_cast<uint8_t>((1 * a1 + 15 * a2 + 8) >> 4));
-    }
-  }
-}
-
-void Downsampled::GetLowresBlock(int16_t *out, int u, int v) const {
-  // Pick out the four values in the corners of the block.
-  int row1 = v;
-  int row2 = std::min(m_rows - 1, v + 1);
-  int col1 = u;
-  int col2 = std::min(m_columns - 1, u + 1);
-  int16_t x11 = static_cast<int16_t>(m_data[row1 * m_columns + col1]);
-  int16_t x12 = static_cast<int16_t>(m_data[row1 * m_columns + col2]);
-  int16_t x21 = static_cast<int16_t>(m_data[row2 * m_columns + col1]);
-  int16_t x22 = static_cast<int16_t>(m_data[row2 * m_columns + col2]);
-
+// Bilinear interpolation of the four corner values of a block, by repeated
+// subdivision. The result is stored with a row stride of stride values.
+void InterpolateBlock(int16_t *out,
+                      int stride,
+                      int16_t x11,
+                      int16_t x12,
+                      int16_t x21,
+                      int16_t x22) {
   // Liner interpolation to produce the left and right columns of the block.
   int16_t left[9], right[9];
   left[0] = x11;
@@ -164,221 +114,605 @@ void Downsampled::GetLowresBlock(int16_t *out, int u, int v) const {
     out[5] = a5;
     out[6] = a6;
     out[7] = a7;
-    out += 8;
+    out += stride;
   }
 }
 
-int Downsampled::BlockDataSizePerChannel(int rows, int columns) {
-  const int macro_rows = NumMacroBlocks(rows);
-  const int macro_columns = NumMacroBlocks(columns);
-  return macro_rows * macro_columns + rows * columns;
+#if defined(__SSE2__)
+// Fill in a[1] to a[7] by subdividing the interval between a[0] and a[8], in
+// the same way as InterpolateBlock().
+inline void Subdivide(__m128i *a) {
+  a[4] = _mm_avg_epu16(a[0], a[8]);
+  a[2] = _mm_avg_epu16(a[0], a[4]);
+  a[6] = _mm_avg_epu16(a[4], a[8]);
+  a[1] = _mm_avg_epu16(a[0], a[2]);
+  a[3] = _mm_avg_epu16(a[2], a[4]);
+  a[5] = _mm_avg_epu16(a[4], a[6]);
+  a[7] = _mm_avg_epu16(a[6], a[8]);
 }
 
-void Downsampled::GetBlockData(uint8_t *out, const Mapper &mapper) const {
-  const int macro_rows = NumMacroBlocks(m_rows);
-  const int macro_columns = NumMacroBlocks(m_columns);
+// Transpose an 8x8 matrix of 16-bit values (one row per vector).
+inline void Transpose8x8(__m128i *a) {
+  const __m128i t0 = _mm_unpacklo_epi16(a[0], a[1]);
+  const __m128i t1 = _mm_unpackhi_epi16(a[0], a[1]);
+  const __m128i t2 = _mm_unpacklo_epi16(a[2], a[3]);
+  const __m128i t3 = _mm_unpackhi_epi16(a[2], a[3]);
+  const __m128i t4 = _mm_unpacklo_epi16(a[4], a[5]);
+  const __m128i t5 = _mm_unpackhi_epi16(a[4], a[5]);
+  const __m128i t6 = _mm_unpacklo_epi16(a[6], a[7]);
+  const __m128i t7 = _mm_unpackhi_epi16(a[6], a[7]);
+  const __m128i s0 = _mm_unpacklo_epi32(t0, t2);
+  const __m128i s1 = _mm_unpackhi_epi32(t0, t2);
+  const __m128i s2 = _mm_unpacklo_epi32(t1, t3);
+  const __m128i s3 = _mm_unpackhi_epi32(t1, t3);
+  const __m128i s4 = _mm_unpacklo_epi32(t4, t6);
+  const __m128i s5 = _mm_unpackhi_epi32(t4, t6);
+  const __m128i s6 = _mm_unpacklo_epi32(t5, t7);
+  const __m128i s7 = _mm_unpackhi_epi32(t5, t7);
+  a[0] = _mm_unpacklo_epi64(s0, s4);
+  a[1] = _mm_unpackhi_epi64(s0, s4);
+  a[2] = _mm_unpacklo_epi64(s1, s5);
+  a[3] = _mm_unpackhi_epi64(s1, s5);
+  a[4] = _mm_unpacklo_epi64(s2, s6);
+  a[5] = _mm_unpackhi_epi64(s2, s6);
+  a[6] = _mm_unpacklo_epi64(s3, s7);
+  a[7] = _mm_unpackhi_epi64(s3, s7);
+}
+#endif
+
+// Restore the sample that is predicted by predicted, from the mapped delta.
+inline uint8_t RestoreSample(int16_t predicted,
+                             uint8_t delta8,
+                             const Mapper &mapper) {
+  int16_t actual = predicted + mapper.UnmapFrom8Bit(delta8);
+  return static_cast<uint8_t>(
+      std::max(int16_t(0), std::min(actual, int16_t(255))));
+}
 
-  // Determine the best predictor for each macro block.
-  uint8_t *predictor_selection = out;
-  {
-    int predictor_error[kNumPredictors];
-    for (int mv = 0; mv < macro_rows; ++mv) {
-      int v0 = mv * kMacroBlockSize;
-      for (int mu = 0; mu < macro_columns; ++mu) {
-        int u0 = mu * kMacroBlockSize;
-
-        // Clear the prediction error vector.
-        for (int i = 0; i < kNumPredictors; ++i)
-          predictor_error[i] = 0;
-
-        // Iterate over all the pixels of this macro block.
-        for (int dv = 0; dv < kMacroBlockSize; ++dv) {
-          int v = v0 + dv;
-          if (v >= m_rows)
-            break;
-
-          for (int du = 0; du < kMacroBlockSize; ++du) {
-            int u = u0 + du;
-            if (u >= m_columns)
-              break;
-
-            // Extract the three neighbour samples that we use for
-            // prediction.
-            int16_t s1, s2, s3;
-            if (du > 0 && dv > 0) {
-              s1 =
-                  static_cast<int16_t>(m_data[(v - 1) * m_columns + u - 1]);
-              s2 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-              s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-            } else if (du > 0) {
-              s1 = s2 = s3 =
-                  static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-            } else if (dv > 0) {
-              s1 = s2 = s3 =
-                  static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-            } else {
-              s1 = s2 = s3 = 128;
-            }
-
-            // Try all the predictors.
-            for (int predictor = 0; predictor < kNumPredictors;
-                 ++predictor) {
-              // Calculate the prediction error for this predictor.
-              int16_t predicted = PredictSample(s1, s2, s3, predictor);
-              int16_t actual =
-                  static_cast<int16_t>(m_data[v * m_columns + u]);
-              int delta = static_cast<int>(actual - predicted);
-              int err = delta * delta;
-
-              // Accumulate the prediction error for this predictor.
-              predictor_error[predictor] += err;
-            }
-          }
-        }
+// Reconstruct the samples of a macro block of width x height samples, that uses
+// PREDICTOR, from the deltas in in. Returns a pointer to the following deltas.
+template <int PREDICTOR>
+const uint8_t *RestoreMacroBlock(uint8_t *out,
+                                 int stride,
+                                 int width,
+                                 int height,
+                                 const uint8_t *in,
+                                 const Mapper &mapper) {
+  // Along the top and left edges, all three neighbours are replaced by the
+  // single neighbour that is inside the macro block (or by 128 for the first
+  // sample), and then all the predictors give that very sample.
+  int16_t left = 128;
+  for (int du = 0; du < width; ++du) {
+    out[du] = RestoreSample(left, *in++, mapper);
+    left = static_cast<int16_t>(out[du]);
+  }
 
-        // Select the best predictor for this macro block.
-        int best_predictor = 0;
-        int best_error = predictor_error[0];
-        for (int predictor = 1; predictor < kNumPredictors; ++predictor) {
-          if (predictor_error[predictor] < best_error) {
-            best_predictor = predictor;
-            best_error = predictor_error[predictor];
-          }
+  for (int dv = 1; dv < height; ++dv) {
+    const uint8_t *above = out;
+    out += stride;
+    out[0] = RestoreSample(static_cast<int16_t>(above[0]), *in++, mapper);
+    for (int du = 1; du < width; ++du) {
+      int16_t predicted = PredictSample(static_cast<int16_t>(above[du - 1]),
+                                        static_cast<int16_t>(above[du]),
+                                        static_cast<int16_t>(out[du - 1]),
+                                        PREDICTOR);
+      out[du] = RestoreSample(predicted, *in++, mapper);
+    }
+  }
+
+  return in;
+}
+
+// Select the predictor that gives the smallest squared prediction error for a
+// macro block of width x height samples. Along the top and left edges of the
+// macro block all the predictors give the same prediction (see
+// RestoreMacroBlock()), so those samples do not affect the selection and are
+// left out.
+int SelectPredictor(const uint8_t *in, int stride, int width, int height) {
+  int predictor_error[kNumPredictors] = {0};
+
+#if defined(__SSE2__)
+  if (width == kMacroBlockSize) {
+    // Process one line of the macro block at a time, as two vectors of eight
+    // 16-bit samples. The first sample of each line (du = 0) is masked out.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i two = _mm_set1_epi16(2);
+    const __m128i first_mask = _mm_set_epi16(-1, -1, -1, -1, -1, -1, -1, 0);
+    __m128i error[kNumPredictors];
+    for (int i = 0; i < kNumPredictors; ++i)
+      error[i] = zero;
+    for (int dv = 1; dv < height; ++dv) {
+      // The left neighbours are shifted in from the same vectors (the first
+      // sample has no left neighbour, but it is masked out anyway).
+      const uint8_t *line = in + dv * stride;
+      const __m128i a8 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(line));
+      const __m128i s2_8 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(line - stride));
+      const __m128i s1_8 = _mm_slli_si128(s2_8, 1);
+      const __m128i s3_8 = _mm_slli_si128(a8, 1);
+      for (int half = 0; half < 2; ++half) {
+        __m128i a, s1, s2, s3;
+        if (half == 0) {
+          a = _mm_unpacklo_epi8(a8, zero);
+          s1 = _mm_unpacklo_epi8(s1_8, zero);
+          s2 = _mm_unpacklo_epi8(s2_8, zero);
+          s3 = _mm_unpacklo_epi8(s3_8, zero);
+        } else {
+          a = _mm_unpackhi_epi8(a8, zero);
+          s1 = _mm_unpackhi_epi8(s1_8, zero);
+          s2 = _mm_unpackhi_epi8(s2_8, zero);
+          s3 = _mm_unpackhi_epi8(s3_8, zero);
         }
 
-        // Output the predictor.
-        *out++ = EncodePredictor(best_predictor);
+        // The five predictions (see PredictSample()).
+        const __m128i sum23 = _mm_add_epi16(s2, s3);
+        __m128i predicted[kNumPredictors];
+        predicted[0] = _mm_srai_epi16(
+            _mm_add_epi16(
+                _mm_sub_epi16(_mm_add_epi16(sum23, _mm_add_epi16(sum23, sum23)),
+                              _mm_add_epi16(s1, s1)),
+                two),
+            2);
+        predicted[0] = _mm_min_epi16(_mm_max_epi16(predicted[0], zero), max);
+        predicted[1] = s2;
+        predicted[2] = s3;
+        predicted[3] = _mm_avg_epu16(s2, s3);
+        predicted[4] = _mm_min_epi16(
+            _mm_max_epi16(_mm_sub_epi16(sum23, s1), zero), max);
+
+        // Accumulate the squared prediction errors (as 32-bit sums).
+        for (int i = 0; i < kNumPredictors; ++i) {
+          __m128i delta = _mm_sub_epi16(a, predicted[i]);
+          if (half == 0)
+            delta = _mm_and_si128(delta, first_mask);
+          error[i] = _mm_add_epi32(error[i], _mm_madd_epi16(delta, delta));
+        }
+      }
+    }
+    for (int i = 0; i < kNumPredictors; ++i) {
+      __m128i sum = _mm_add_epi32(error[i], _mm_srli_si128(error[i], 8));
+      sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+      predictor_error[i] = _mm_cvtsi128_si32(sum);
+    }
+  } else
+#endif
+  {
+    for (int dv = 1; dv < height; ++dv) {
+      const uint8_t *line = in + dv * stride;
+      const uint8_t *above = line - stride;
+      for (int du = 1; du < width; ++du) {
+        const int16_t s1 = static_cast<int16_t>(above[du - 1]);
+        const int16_t s2 = static_cast<int16_t>(above[du]);
+        const int16_t s3 = static_cast<int16_t>(line[du - 1]);
+        const int16_t actual = static_cast<int16_t>(line[du]);
+        for (int i = 0; i < kNumPredictors; ++i) {
+          int delta = static_cast<int>(actual - PredictSample(s1, s2, s3, i));
+          predictor_error[i] += delta * delta;
+        }
       }
     }
   }
 
-  // We use a temporary working buffer for the two most recent lines in the
-  // macro block.
+  // Select the best predictor (the first one, in case of a tie).
+  int best_predictor = 0;
+  for (int i = 1; i < kNumPredictors; ++i) {
+    if (predictor_error[i] < predictor_error[best_predictor])
+      best_predictor = i;
+  }
+  return best_predictor;
+}
+
+// Calculate the mapped delta between the actual sample and the predicted
+// sample. Returns the sample that the decoder will restore (see
+// RestoreSample()), so that the encoder can use the same (quantized) samples
+// for the following predictions as the decoder.
+inline uint8_t EncodeSample(int16_t predicted,
+                            uint8_t actual,
+                            uint8_t *delta8,
+                            const Mapper &mapper) {
+  *delta8 = mapper.MapTo8Bit(static_cast<int16_t>(actual) - predicted);
+  return RestoreSample(predicted, *delta8, mapper);
+}
+
+// Produce the deltas for a macro block of width x height samples that uses
+// PREDICTOR (this is the inverse of RestoreMacroBlock()). Returns a pointer to
+// the end of the produced deltas.
+template <int PREDICTOR>
+uint8_t *EncodeMacroBlock(uint8_t *out,
+                          const uint8_t *in,
+                          int stride,
+                          int width,
+                          int height,
+                          const Mapper &mapper) {
+  // We use a temporary working buffer for the two most recent (restored)
+  // lines in the macro block.
   uint8_t work_buf[kMacroBlockSize * 2];
-  uint8_t *lines[2] = {&work_buf[0], &work_buf[kMacroBlockSize]};
-
-  // Iterate over all macro blocks.
-  for (int mv = 0; mv < macro_rows; ++mv) {
-    int v0 = mv * kMacroBlockSize;
-    for (int mu = 0; mu < macro_columns; ++mu) {
-      int u0 = mu * kMacroBlockSize;
-
-      // Get the predictor for this macro block.
-      int predictor =
-          DecodePredictor(predictor_selection[mv * macro_columns + mu]);
-
-      // Iterate over all the pixels of this macro block.
-      for (int dv = 0; dv < kMacroBlockSize; ++dv) {
-        int v = v0 + dv;
-        if (v >= m_rows)
-          break;
-
-        for (int du = 0; du < kMacroBlockSize; ++du) {
-          int u = u0 + du;
-          if (u >= m_columns)
-            break;
-
-          // Extract the three neighbour samples that we use for prediction.
-          int16_t s1, s2, s3;
-          if (du > 0 && dv > 0) {
-            s1 = static_cast<int16_t>(lines[0][du - 1]);
-            s2 = static_cast<int16_t>(lines[0][du]);
-            s3 = static_cast<int16_t>(lines[1][du - 1]);
-          } else if (du > 0) {
-            s1 = s2 = s3 = static_cast<int16_t>(lines[1][du - 1]);
-          } else if (dv > 0) {
-            s1 = s2 = s3 = static_cast<int16_t>(lines[0][du]);
-          } else {
-            s1 = s2 = s3 = 128;
-          }
-
-          // Predict the current sample.
-          int16_t predicted = PredictSample(s1, s2, s3, predictor);
-
-          // Calculate the delta to the prediction.
-          int16_t actual = static_cast<int16_t>(m_data[v * m_columns + u]);
-          int16_t delta = actual - predicted;
-          uint8_t delta8 = mapper.MapTo8Bit(delta);
-
-          // Compensate actual value for quantization (i.e. mimic the decoder).
-          actual = predicted + mapper.UnmapFrom8Bit(delta8);
-          actual = std::max(int16_t(0), std::min(actual, int16_t(255)));
-          lines[1][du] = static_cast<uint8_t>(actual);
-
-          // Output the quantized delta value.
-          *out++ = delta8;
-        }
+  uint8_t *above = &work_buf[0];
+  uint8_t *line = &work_buf[kMacroBlockSize];
+
+  int16_t left = 128;
+  for (int du = 0; du < width; ++du) {
+    line[du] = EncodeSample(left, in[du], out++, mapper);
+    left = static_cast<int16_t>(line[du]);
+  }
+
+  for (int dv = 1; dv < height; ++dv) {
+    std::swap(above, line);
+    in += stride;
+    line[0] =
+        EncodeSample(static_cast<int16_t>(above[0]), in[0], out++, mapper);
+    for (int du = 1; du < width; ++du) {
+      int16_t predicted = PredictSample(static_cast<int16_t>(above[du - 1]),
+                                        static_cast<int16_t>(above[du]),
+                                        static_cast<int16_t>(line[du - 1]),
+                                        PREDICTOR);
+      line[du] = EncodeSample(predicted, in[du], out++, mapper);
+    }
+  }
 
-        std::swap(lines[0], lines[1]);
+  return out;
+}
+
+}  // namespace
+
+Downsampled::Downsampled() : m_rows(0), m_columns(0) {
+}
+
+void Downsampled::SampleImage(const uint8_t *pixels,
+                              int stride,
+                              int width,
+                              int height) {
+  StartSampling(width, height);
+  std::vector<uint16_t> column_sums;
+  for (int v = 0; v < m_rows; ++v) {
+    int first_row, end_row;
+    SampledRows(v, height, &first_row, &end_row);
+    SampleBlockRow(this,
+                   1,
+                   pixels + first_row * width * stride,
+                   stride,
+                   width,
+                   height,
+                   v,
+                   &column_sums);
+  }
+  FinishSampling();
+}
+
+void Downsampled::StartSampling(int width, int height) {
+  // Divide by 8x8, rounding up.
+  m_rows = (height + 7) >> 3;
+  m_columns = (width + 7) >> 3;
+
+  // The average colors are stored in m_data until FinishSampling() is called.
+  m_data.resize(m_rows * m_columns);
+}
+
+void Downsampled::SampleBlockRow(Downsampled *channels,
+                                 int num_channels,
+                                 const uint8_t *rows,
+                                 int pixel_stride,
+                                 int width,
+                                 int height,
+                                 int v,
+                                 std::vector<uint16_t> *column_sums) {
+  int y_min, y_end;
+  SampledRows(v, height, &y_min, &y_end);
+  const int num_rows = y_end - y_min;
+
+  // Sum the sampled rows of each image column, for all channels in one pass
+  // over the interleaved pixels. A column sum is at most 8 * 255, and a block
+  // sum is at most 64 * 255, so 16 bits are enough.
+  const int row_size = width * num_channels;
+  column_sums->assign(row_size, 0);
+  uint16_t *sums = column_sums->data();
+  for (int y = 0; y < num_rows; ++y) {
+    const uint8_t *row = rows + y * width * pixel_stride;
+    if (pixel_stride == num_channels) {
+      int i = 0;
+#if defined(__SSE2__)
+      const __m128i zero = _mm_setzero_si128();
+      for (; i + 16 <= row_size; i += 16) {
+        const __m128i p =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+        __m128i *s = reinterpret_cast<__m128i *>(sums + i);
+        _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s),
+                                          _mm_unpacklo_epi8(p, zero)));
+        _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1),
+                                              _mm_unpackhi_epi8(p, zero)));
+      }
+#endif
+      for (; i < row_size; ++i)
+        sums[i] += row[i];
+    } else {
+      for (int x = 0; x < width; ++x) {
+        for (int k = 0; k < num_channels; ++k)
+          sums[x * num_channels + k] += row[x * pixel_stride + k];
       }
     }
   }
+
+  // Calculate average color for each 8x8 block. The sampling windows of
+  // neighbouring blocks do not overlap, so every column sum is only used once.
+  const int columns = channels[0].m_columns;
+  for (int u = 0; u < columns; ++u) {
+    const int x_min = std::max(0, u * 8 - 3);
+    const int x_end = std::min(width, u * 8 + 5);
+    const int total_count = (x_end - x_min) * num_rows;
+    for (int k = 0; k < num_channels; ++k) {
+      const uint16_t *column = sums + x_min * num_channels + k;
+      uint16_t sum = 0;
+      for (int x = x_min; x < x_end; ++x) {
+        sum += *column;
+        column += num_channels;
+      }
+      channels[k].m_data[v * columns + u] =
+          static_cast<uint8_t>((sum + (total_count >> 1)) / total_count);
+    }
+  }
 }
 
-void Downsampled::SetBlockData(
-    const uint8_t *in, int rows, int columns, const Mapper &mapper) {
+void Downsampled::FinishSampling() {
+  // Compensate blocks for lienear interpolation (phase shift 1/16 pixels up &
+  // to the left). This is done in place, from the last block to the first, so
+  // that the average colors above and to the left are still intact.
+  for (int v = m_rows - 1; v >= 0; --v) {
+    int row1 = std::max(0, v - 1);
+    int row2 = v;
+    for (int u = m_columns - 1; u >= 0; --u) {
+      int col1 = std::max(0, u - 1);
+      int col2 = u;
+      uint16_t x11 = static_cast<uint16_t>(m_data[row1 * m_columns + col1]);
+      uint16_t x12 = static_cast<uint16_t>(m_data[row1 * m_columns + col2]);
+      uint16_t x21 = static_cast<uint16_t>(m_data[row2 * m_columns + col1]);
+      uint16_t x22 = static_cast<uint16_t>(m_data[row2 * m_columns + col2]);
+      uint16_t a1 = (1 * x11 + 15 * x12 + 8) >> 4;
+      uint16_t a2 = (1 * x21 + 15 * x22 + 8) >> 4;
+      m_data[row2 * m_columns + col2] =
+          static_cast<uint8_t>((1 * a1 + 15 * a2 + 8) >> 4);
+    }
+  }
+}
+
+void Downsampled::SampledRows(int v, int height, int *first_row, int *end_row) {
+  *first_row = std::max(0, v * 8 - 3);
+  *end_row = std::min(height, v * 8 + 5);
+}
+
+void Downsampled::GetLowresBlock(int16_t *out, int u, int v) const {
+  // Pick out the four values in the corners of the block.
+  int row1 = v;
+  int row2 = std::min(m_rows - 1, v + 1);
+  int col1 = u;
+  int col2 = std::min(m_columns - 1, u + 1);
+  InterpolateBlock(out,
+                   8,
+                   static_cast<int16_t>(m_data[row1 * m_columns + col1]),
+                   static_cast<int16_t>(m_data[row1 * m_columns + col2]),
+                   static_cast<int16_t>(m_data[row2 * m_columns + col1]),
+                   static_cast<int16_t>(m_data[row2 * m_columns + col2]));
+}
+
+void Downsampled::GetLowresBlockRow(
+    int16_t *out, int line_stride, int v, int first_u, int end_u) const {
+  const uint8_t *row1 = &m_data[v * m_columns];
+  const uint8_t *row2 = &m_data[std::min(m_rows - 1, v + 1) * m_columns];
+  int u = first_u;
+
+#if defined(__SSE2__)
+  // Interpolate eight blocks at a time, with one block per 16-bit lane (this
+  // requires that the right hand neighbour of each block exists). The rounding
+  // average is the same as (a + b + 1) >> 1 (since all values are positive),
+  // so the result is identical to InterpolateBlock().
+  const __m128i zero = _mm_setzero_si128();
+  for (; u + 8 < m_columns && u + 8 <= end_u; u += 8) {
+    // Vertical interpolation of the left and right columns of the blocks.
+    __m128i left[9], right[9];
+    left[0] = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row1 + u)), zero);
+    left[8] = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row2 + u)), zero);
+    right[0] = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row1 + u + 1)), zero);
+    right[8] = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row2 + u + 1)), zero);
+    Subdivide(left);
+    Subdivide(right);
+
+    int16_t *line = out + (u - first_u) * 8;
+    for (int y = 0; y < 8; ++y) {
+      // Horizontal interpolation of this line of the blocks.
+      __m128i a[9];
+      a[0] = left[y];
+      a[8] = right[y];
+      Subdivide(a);
+
+      // Transpose, to get the eight values of each block in one vector.
+      Transpose8x8(a);
+      for (int k = 0; k < 8; ++k)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(line + k * 8), a[k]);
+      line += line_stride;
+    }
+  }
+#endif
+
+  for (; u < end_u; ++u) {
+    int u2 = std::min(m_columns - 1, u + 1);
+    InterpolateBlock(out + (u - first_u) * 8,
+                     line_stride,
+                     static_cast<int16_t>(row1[u]),
+                     static_cast<int16_t>(row1[u2]),
+                     static_cast<int16_t>(row2[u]),
+                     static_cast<int16_t>(row2[u2]));
+  }
+}
+
+void Downsampled::GetLowresBlockScaled(int16_t *out,
+                                       int u,
+                                       int v,
+                                       int size) const {
+  // Pick out the four values in the corners of the block.
+  int row1 = v;
+  int row2 = std::min(m_rows - 1, v + 1);
+  int col1 = u;
+  int col2 = std::min(m_columns - 1, u + 1);
+  int x11 = static_cast<int>(m_data[row1 * m_columns + col1]);
+  int x12 = static_cast<int>(m_data[row1 * m_columns + col2]);
+  int x21 = static_cast<int>(m_data[row2 * m_columns + col1]);
+  int x22 = static_cast<int>(m_data[row2 * m_columns + col2]);
+
+  // Bilinear interpolation at the center of each downscaled pixel. A pixel
+  // covers s = 8 / size full resolution pixels, so pixel k is centered at
+  // s * k + (s - 1) / 2, i.e. at (2 * s * k + s - 1) / 16 of the block.
+  const int s = 8 / size;
+  for (int y = 0; y < size; ++y) {
+    int fy = 2 * s * y + s - 1;
+    int left = x11 * (16 - fy) + x21 * fy;
+    int right = x12 * (16 - fy) + x22 * fy;
+    for (int x = 0; x < size; ++x) {
+      int fx = 2 * s * x + s - 1;
+      out[x] = static_cast<int16_t>((left * (16 - fx) + right * fx + 128) >> 8);
+    }
+    out += 8;
+  }
+}
+
+void Downsampled::GetThumbnailRow(uint8_t *out,
+                                  int pixel_stride,
+                                  int v,
+                                  bool smooth) const {
+  const uint8_t *row1 = &m_data[v * m_columns];
+  if (!smooth) {
+    for (int u = 0; u < m_columns; ++u) {
+      *out = row1[u];
+      out += pixel_stride;
+    }
+    return;
+  }
+
+  // The samples are located at the upper left corner of each block, so the
+  // value at the center of the block is roughly the average of the four
+  // samples in the corners of the block (see GetLowresBlock()).
+  const uint8_t *row2 = &m_data[std::min(m_rows - 1, v + 1) * m_columns];
+  for (int u = 0; u < m_columns; ++u) {
+    int u2 = std::min(m_columns - 1, u + 1);
+    int sum = static_cast<int>(row1[u]) + static_cast<int>(row1[u2]) +
+              static_cast<int>(row2[u]) + static_cast<int>(row2[u2]);
+    *out = static_cast<uint8_t>((sum + 2) >> 2);
+    out += pixel_stride;
+  }
+}
+
+int Downsampled::BlockDataSizePerChannel(int rows, int columns) {
   const int macro_rows = NumMacroBlocks(rows);
   const int macro_columns = NumMacroBlocks(columns);
+  return macro_rows * macro_columns + rows * columns;
+}
+
+void Downsampled::GetBlockData(uint8_t *out, const Mapper &mapper) const {
+  for (int mv = 0; mv < NumMacroBlocks(m_rows); ++mv)
+    GetMacroBlockRow(out, mv, mapper);
+}
 
+void Downsampled::GetMacroBlockRow(uint8_t *out,
+                                   int mv,
+                                   const Mapper &mapper) const {
+  const int macro_columns = NumMacroBlocks(m_columns);
+  const int v0 = mv * kMacroBlockSize;
+  const int height = std::min(kMacroBlockSize, m_rows - v0);
+
+  // See SetMacroBlockRow() for the data layout.
+  uint8_t *predictor_selection = out + mv * macro_columns;
+  out += NumMacroBlocks(m_rows) * macro_columns + v0 * m_columns;
+
+  for (int mu = 0; mu < macro_columns; ++mu) {
+    const int u0 = mu * kMacroBlockSize;
+    const int width = std::min(kMacroBlockSize, m_columns - u0);
+    const uint8_t *in = &m_data[v0 * m_columns + u0];
+
+    // Determine the best predictor for this macro block.
+    const int predictor = SelectPredictor(in, m_columns, width, height);
+    predictor_selection[mu] = EncodePredictor(predictor);
+
+    // Output the deltas, using a specialized loop for the selected predictor.
+    // Note: The predictor is passed through EncodePredictor() and
+    // DecodePredictor() to use exactly the same predictor as the decoder.
+    switch (DecodePredictor(predictor_selection[mu])) {
+      default:
+        out = EncodeMacroBlock<0>(out, in, m_columns, width, height, mapper);
+        break;
+      case 1:
+        out = EncodeMacroBlock<1>(out, in, m_columns, width, height, mapper);
+        break;
+      case 2:
+        out = EncodeMacroBlock<2>(out, in, m_columns, width, height, mapper);
+        break;
+      case 3:
+        out = EncodeMacroBlock<3>(out, in, m_columns, width, height, mapper);
+        break;
+      case 4:
+        out = EncodeMacroBlock<4>(out, in, m_columns, width, height, mapper);
+        break;
+    }
+  }
+}
+
+void Downsampled::SetBlockData(
+    const uint8_t *in, int rows, int columns, const Mapper &mapper) {
+  StartBlockData(rows, columns);
+  for (int mv = 0; mv < NumMacroBlockRows(rows); ++mv)
+    SetMacroBlockRow(in, mv, mapper);
+}
+
+void Downsampled::StartBlockData(int rows, int columns) {
   m_rows = rows;
   m_columns = columns;
   m_data.resize(m_rows * m_columns);
+}
+
+void Downsampled::SetMacroBlockRow(const uint8_t *in,
+                                   int mv,
+                                   const Mapper &mapper) {
+  const int macro_columns = NumMacroBlocks(m_columns);
+  const int v0 = mv * kMacroBlockSize;
+  const int height = std::min(kMacroBlockSize, m_rows - v0);
 
   // The per macro-block predictor selection comes first (one byte per macro
-  // block).
-  const uint8_t *predictor_selection = in;
-  in += macro_rows * macro_columns;
-
-  // Reconstruct samples (integrate deltas) for all macro blocks.
-  for (int mv = 0; mv < macro_rows; ++mv) {
-    int v0 = mv * kMacroBlockSize;
-    for (int mu = 0; mu < macro_columns; ++mu) {
-      int u0 = mu * kMacroBlockSize;
-
-      // Get the predictor for this macro block.
-      int predictor =
-          DecodePredictor(predictor_selection[mv * macro_columns + mu]);
-
-      // Iterate over all the pixels of this macro block.
-      for (int dv = 0; dv < kMacroBlockSize; ++dv) {
-        int v = v0 + dv;
-        if (v >= m_rows)
-          break;
-
-        for (int du = 0; du < kMacroBlockSize; ++du) {
-          int u = u0 + du;
-          if (u >= m_columns)
-            break;
-
-          // Extract the three neighbour samples that we use for prediction.
-          int16_t s1, s2, s3;
-          if (du > 0 && dv > 0) {
-            s1 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u - 1]);
-            s2 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-            s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-          } else if (du > 0) {
-            s1 = s2 = s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-          } else if (dv > 0) {
-            s1 = s2 = s3 =
-                static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-          } else {
-            s1 = s2 = s3 = 128;
-          }
-
-          // Predict the current sample.
-          int16_t predicted = PredictSample(s1, s2, s3, predictor);
-
-          // Restore actual value.
-          int16_t delta = mapper.UnmapFrom8Bit(*in++);
-          int16_t actual = predicted + delta;
-          actual = std::max(int16_t(0), std::min(actual, int16_t(255)));
-
-          // Output the restored sample value.
-          m_data[v * m_columns + u] = static_cast<uint8_t>(actual);
-        }
-      }
+  // block), followed by the deltas of one macro block row after the other.
+  const uint8_t *predictor_selection = in + mv * macro_columns;
+  in += NumMacroBlocks(m_rows) * macro_columns + v0 * m_columns;
+
+  // Reconstruct samples (integrate deltas) for all macro blocks of the row.
+  for (int mu = 0; mu < macro_columns; ++mu) {
+    const int u0 = mu * kMacroBlockSize;
+    const int width = std::min(kMacroBlockSize, m_columns - u0);
+    uint8_t *out = &m_data[v0 * m_columns + u0];
+
+    // Use a specialized loop for the predictor of this macro block.
+    switch (DecodePredictor(predictor_selection[mu])) {
+      default:
+        in = RestoreMacroBlock<0>(out, m_columns, width, height, in, mapper);
+        break;
+      case 1:
+        in = RestoreMacroBlock<1>(out, m_columns, width, height, in, mapper);
+        break;
+      case 2:
+        in = RestoreMacroBlock<2>(out, m_columns, width, height, in, mapper);
+        break;
+      case 3:
+        in = RestoreMacroBlock<3>(out, m_columns, width, height, in, mapper);
+        break;
+      case 4:
+        in = RestoreMacroBlock<4>(out, m_columns, width, height, in, mapper);
+        break;
     }
   }
 }
 
+int Downsampled::NumMacroBlockRows(int rows) {
+  return NumMacroBlocks(rows);
+}
+
 }  // namespace himg
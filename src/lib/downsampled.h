@@ -22,14 +22,67 @@ class Downsampled {
 
   void SampleImage(const uint8_t *pixels, int stride, int width, int height);
 
+  // Sample the image one block row at a time (e.g. when the image is converted
+  // to another color space one band at a time). Call StartSampling(), then
+  // SampleBlockRow() for all block rows in order, and finally FinishSampling().
+  // Block row v is sampled from the image rows given by SampledRows(), and
+  // rows points at the first of them.
+  //
+  // SampleBlockRow() samples all the channels of an interleaved image in a
+  // single pass: channel k (of num_channels) is sampled from rows + k into
+  // channels[k]. The column_sums buffer is used as working memory.
+  void StartSampling(int width, int height);
+  static void SampleBlockRow(Downsampled *channels,
+                             int num_channels,
+                             const uint8_t *rows,
+                             int pixel_stride,
+                             int width,
+                             int height,
+                             int v,
+                             std::vector<uint16_t> *column_sums);
+  void FinishSampling();
+
+  // Get the range of image rows, [*first_row, *end_row), that block row v is
+  // sampled from. The ranges of consecutive block rows do not overlap.
+  static void SampledRows(int v, int height, int *first_row, int *end_row);
+
   void GetLowresBlock(int16_t *out, int u, int v) const;
 
+  // Get the low-res component of the blocks first_u to end_u - 1 of block row
+  // v at once, as eight lines of (end_u - first_u) * 8 values that are
+  // line_stride values apart. The result is identical to GetLowresBlock().
+  void GetLowresBlockRow(
+      int16_t *out, int line_stride, int v, int first_u, int end_u) const;
+
+  // Get a low-res block that is downscaled to size x size pixels (size = 4 or
+  // 2), with a row stride of eight.
+  void GetLowresBlockScaled(int16_t *out, int u, int v, int size) const;
+
+  // Get one row of samples (i.e. one sample per block) for a thumbnail image.
+  // If smooth is true, the samples are interpolated at the block centers.
+  void GetThumbnailRow(
+      uint8_t *out, int pixel_stride, int v, bool smooth) const;
+
   static int BlockDataSizePerChannel(int rows, int columns);
 
   void GetBlockData(uint8_t *out, const Mapper &mapper) const;
+
+  // Get the block data for macro block row mv only. The predictor selection
+  // and the deltas are stored at the same places in out as for GetBlockData(),
+  // so the macro block rows can be produced in any order (and in parallel).
+  void GetMacroBlockRow(uint8_t *out, int mv, const Mapper &mapper) const;
+
   void SetBlockData(
       const uint8_t *in, int rows, int columns, const Mapper &mapper);
 
+  // The macro block rows of the block data are independent, so they can be
+  // restored separately (in any order, and from several threads): call
+  // StartBlockData() first, and then SetMacroBlockRow() for each macro block
+  // row (mv). The in pointer is the same as for SetBlockData().
+  void StartBlockData(int rows, int columns);
+  void SetMacroBlockRow(const uint8_t *in, int mv, const Mapper &mapper);
+  static int NumMacroBlockRows(int rows);
+
   int rows() const { return m_rows; }
 
   int columns() const { return m_columns; }
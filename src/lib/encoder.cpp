@@ -10,6 +10,7 @@
 
 #include <algorithm>
 #include <iostream>
+#include <limits>
 
 #include "common.h"
 #include "downsampled.h"
@@ -19,6 +20,10 @@
 #include "quantize.h"
 #include "ycbcr.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace himg {
 
 namespace {
@@ -51,9 +56,149 @@ void ExtractChannelBlock(int16_t *out,
   }
 }
 
+#if defined(__SSE2__)
+// Load one row of eight pixels with N (one to four) channels, and store
+// channel k of the pixels as 16-bit values at out + 64 * k.
+template <int N>
+inline void ExtractPixelRow(int16_t *out, const uint8_t *in) {
+  const __m128i zero = _mm_setzero_si128();
+  if (N == 1) {
+    const __m128i p =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(in));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                     _mm_unpacklo_epi8(p, zero));
+    return;
+  }
+  const __m128i byte_mask = _mm_set1_epi16(255);
+  if (N == 2) {
+    const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                     _mm_and_si128(p, byte_mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 64),
+                     _mm_srli_epi16(p, 8));
+    return;
+  }
+
+  // Get the pixels as 32-bit values (four pixels per vector).
+  __m128i p0, p1;
+  if (N == 4) {
+    p0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    p1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 16));
+  } else {
+    // Spread the 3-byte pixels to 4-byte pixels: pixel i is shifted up by i
+    // bytes, and the (garbage) fourth byte is masked away.
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    const __m128i b =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(in + 16));
+    const __m128i c = _mm_or_si128(_mm_srli_si128(a, 12), _mm_slli_si128(b, 4));
+    const __m128i m0 = _mm_set_epi32(0, 0, 0, 0x00ffffff);
+    const __m128i m1 = _mm_set_epi32(0, 0, 0x00ffffff, 0);
+    const __m128i m2 = _mm_set_epi32(0, 0x00ffffff, 0, 0);
+    const __m128i m3 = _mm_set_epi32(0x00ffffff, 0, 0, 0);
+    p0 = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(a, m0),
+                     _mm_and_si128(_mm_slli_si128(a, 1), m1)),
+        _mm_or_si128(_mm_and_si128(_mm_slli_si128(a, 2), m2),
+                     _mm_and_si128(_mm_slli_si128(a, 3), m3)));
+    p1 = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(c, m0),
+                     _mm_and_si128(_mm_slli_si128(c, 1), m1)),
+        _mm_or_si128(_mm_and_si128(_mm_slli_si128(c, 2), m2),
+                     _mm_and_si128(_mm_slli_si128(c, 3), m3)));
+  }
+
+  // Pick out one channel at a time.
+  const __m128i channel_mask = _mm_set1_epi32(255);
+  for (int k = 0; k < N; ++k) {
+    const __m128i c0 = _mm_and_si128(_mm_srli_epi32(p0, 8 * k), channel_mask);
+    const __m128i c1 = _mm_and_si128(_mm_srli_epi32(p1, 8 * k), channel_mask);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 64 * k),
+                     _mm_packs_epi32(c0, c1));
+  }
+}
+
+// Extract full width (eight pixels wide) blocks of N channels from tightly
+// packed pixels.
+template <int N>
+void ExtractPixelBlockSIMD(int16_t *out,
+                           const uint8_t *in,
+                           int row_stride,
+                           int block_height) {
+  for (int y = 0; y < block_height; y++) {
+    ExtractPixelRow<N>(out + y * 8, in);
+    in += row_stride;
+  }
+
+  // Fill the rows below the image with the last pixel (the same as
+  // ExtractChannelBlock()).
+  for (int k = 0; k < N; ++k) {
+    int16_t *block = out + 64 * k;
+    const __m128i col = _mm_set1_epi16(block[block_height * 8 - 1]);
+    for (int y = block_height; y < 8; y++)
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(block + y * 8), col);
+  }
+}
+#endif
+
+// Extract the blocks of all num_channels channels from interleaved pixels.
+// The values of channel k are stored 64 elements after the values of channel
+// k - 1. Pixels outside of the image are replicated from the closest pixels,
+// as described by ExtractChannelBlock().
+void ExtractPixelBlock(int16_t *out,
+                       const uint8_t *in,
+                       int num_channels,
+                       int pixel_stride,
+                       int row_stride,
+                       int block_width,
+                       int block_height) {
+#if defined(__SSE2__)
+  if (LIKELY(block_width == 8 && pixel_stride == num_channels)) {
+    // Fast path: read each pixel row once for all channels.
+    switch (num_channels) {
+      case 1:
+        ExtractPixelBlockSIMD<1>(out, in, row_stride, block_height);
+        return;
+      case 2:
+        ExtractPixelBlockSIMD<2>(out, in, row_stride, block_height);
+        return;
+      case 3:
+        ExtractPixelBlockSIMD<3>(out, in, row_stride, block_height);
+        return;
+      case 4:
+        ExtractPixelBlockSIMD<4>(out, in, row_stride, block_height);
+        return;
+      default:
+        break;
+    }
+  }
+#endif
+
+  for (int chan = 0; chan < num_channels; ++chan) {
+    ExtractChannelBlock(out + chan * 64,
+                        in,
+                        chan,
+                        pixel_stride,
+                        row_stride,
+                        block_width,
+                        block_height);
+  }
+}
+
 }  // namespace
 
-Encoder::Encoder() {
+Encoder::Encoder(int max_threads, const ThreadPool::Config &pool_config)
+    : m_thread_pool(new ThreadPool(max_threads, pool_config)),
+      m_executor(m_thread_pool.get()),
+      m_worker_scratch(m_executor->num_workers()),
+      m_packed_capacity(0),
+      m_packed_size(0) {
+}
+
+Encoder::Encoder(Executor *executor)
+    : m_executor(executor),
+      m_worker_scratch(m_executor->num_workers()),
+      m_packed_capacity(0),
+      m_packed_size(0) {
 }
 
 bool Encoder::Encode(const uint8_t *data,
@@ -63,33 +208,124 @@ bool Encoder::Encode(const uint8_t *data,
                      int num_channels,
                      int quality,
                      bool use_ycbcr) {
-  m_packed_data.clear();
+  // Encode into the retained output buffer (it only grows when needed, so it
+  // does not take up memory for the worst case size).
+  const int64_t max_size = MaxEncodedSize(width, height, num_channels);
+  if (max_size > std::numeric_limits<int>::max()) {
+    std::cout << "Error: The image is too large.\n";
+    return false;
+  }
+  EncodeImage(data,
+              width,
+              height,
+              pixel_stride,
+              num_channels,
+              quality,
+              use_ycbcr,
+              m_packed_data.get(),
+              m_packed_capacity);
+  m_packed_size = m_out_size;
+
+  return true;
+}
+
+bool Encoder::Encode(const uint8_t *data,
+                     int width,
+                     int height,
+                     int pixel_stride,
+                     int num_channels,
+                     int quality,
+                     bool use_ycbcr,
+                     uint8_t *out,
+                     int out_capacity,
+                     int *out_size) {
+  const int64_t max_size = MaxEncodedSize(width, height, num_channels);
+  if (max_size > std::numeric_limits<int>::max()) {
+    std::cout << "Error: The image is too large.\n";
+    return false;
+  }
+  if (out_capacity < max_size) {
+    std::cout << "Error: The output buffer is too small.\n";
+    return false;
+  }
+  EncodeImage(data,
+              width,
+              height,
+              pixel_stride,
+              num_channels,
+              quality,
+              use_ycbcr,
+              out,
+              out_capacity);
+  *out_size = m_out_size;
+
+  return true;
+}
+
+int64_t Encoder::MaxEncodedSize(int width, int height, int num_channels) {
+  // The sizes of the Huffman compressed data are bounded by
+  // HuffmanEnc::MaxCompressedSize(), and the mapping functions take at most
+  // 1 + 2 * 127 bytes each. Every chunk has an eight byte header. Everything is
+  // computed in 64 bits, since the bound is larger than the image data.
+  const int rows = (height + 7) >> 3;
+  const int columns = (width + 7) >> 3;
+  const int64_t num_blocks = static_cast<int64_t>(rows) * columns;
+  const int64_t num_macro_blocks =
+      static_cast<int64_t>(Downsampled::NumMacroBlockRows(rows)) *
+      Downsampled::NumMacroBlockRows(columns);
+  const int64_t low_res_channel_size = num_macro_blocks + num_blocks;
+  const int64_t full_res_row_size = static_cast<int64_t>(columns) * 64 *
+                                    num_channels;
+  const int kMaxMappingFunctionSize = 1 + 2 * 127;
+  const int kMaxQuantizationConfigSize = 64;
+  return 12 +                                  // RIFF header
+         8 + 11 +                              // FRMT
+         8 + kMaxMappingFunctionSize +         // LMAP
+         8 + 4 +                               // LRES
+         HuffmanEnc::MaxCompressedSize(low_res_channel_size * num_channels,
+                                       low_res_channel_size) +
+         8 + kMaxQuantizationConfigSize +      // QCFG
+         8 + kMaxMappingFunctionSize +         // FMAP
+         8 + 4 +                               // FRES
+         HuffmanEnc::MaxCompressedSize(full_res_row_size * rows,
+                                       full_res_row_size);
+}
+
+void Encoder::EncodeImage(const uint8_t *data,
+                          int width,
+                          int height,
+                          int pixel_stride,
+                          int num_channels,
+                          int quality,
+                          bool use_ycbcr,
+                          uint8_t *out,
+                          int out_capacity) {
+  m_out = out;
+  m_out_capacity = out_capacity;
+  m_out_size = 0;
 
   m_quality = quality;
   m_use_ycbcr = use_ycbcr && (num_channels >= 3);
 
+  // The image, for the parallel tasks.
+  m_data = data;
+  m_width = width;
+  m_height = height;
+  m_pixel_stride = pixel_stride;
+  m_num_channels = num_channels;
+
   // This is a RIFF file.
   EncodeRIFFStart();
 
   // Header data.
   EncodeHeader(width, height, num_channels);
 
-  // Optionally convert to YCrCb.
-  const uint8_t *color_space_data = data;
-  std::vector<uint8_t> ycbcr_data;
-  if (m_use_ycbcr) {
-    ycbcr_data.resize(width * height * pixel_stride);
-    YCbCr::RGBToYCbCr(
-        ycbcr_data.data(), data, width, height, pixel_stride, num_channels);
-    color_space_data = ycbcr_data.data();
-  }
-
   // Generate & encode the mapping function for the low resolution image.
   m_low_res_mapper.InitForQuality(m_quality);
   EncodeLowResMappingFunction();
 
   // Low resolution data.
-  EncodeLowRes(color_space_data, width, height, pixel_stride, num_channels);
+  EncodeLowRes(data, width, height, pixel_stride, num_channels);
 
   // Generate the quantization configuration for the full resolution data.
   m_quantize.InitForQuality(m_quality, m_use_ycbcr);
@@ -100,87 +336,79 @@ bool Encoder::Encode(const uint8_t *data,
   EncodeFullResMappingFunction();
 
   // Full resolution data.
-  EncodeFullRes(color_space_data, width, height, pixel_stride, num_channels);
+  EncodeFullRes(width, height, num_channels);
 
   // Update the RIFF header.
   UpdateRIFFStart();
-
-  return true;
 }
 
 void Encoder::EncodeRIFFStart() {
-  m_packed_data.reserve(12);
-
-  m_packed_data.push_back('R');
-  m_packed_data.push_back('I');
-  m_packed_data.push_back('F');
-  m_packed_data.push_back('F');
+  AppendByte('R');
+  AppendByte('I');
+  AppendByte('F');
+  AppendByte('F');
 
   // The file size, which is updated once the compression process is completed.
-  m_packed_data.push_back(0);
-  m_packed_data.push_back(0);
-  m_packed_data.push_back(0);
-  m_packed_data.push_back(0);
-
-  m_packed_data.push_back('H');
-  m_packed_data.push_back('I');
-  m_packed_data.push_back('M');
-  m_packed_data.push_back('G');
+  AppendByte(0);
+  AppendByte(0);
+  AppendByte(0);
+  AppendByte(0);
+
+  AppendByte('H');
+  AppendByte('I');
+  AppendByte('M');
+  AppendByte('G');
 }
 
 void Encoder::UpdateRIFFStart() {
-  uint32_t file_size = m_packed_data.size() - 8;
-  m_packed_data[4] = file_size & 255;
-  m_packed_data[5] = (file_size >> 8) & 255;
-  m_packed_data[6] = (file_size >> 16) & 255;
-  m_packed_data[7] = (file_size >> 24) & 255;
+  uint32_t file_size = m_out_size - 8;
+  m_out[4] = file_size & 255;
+  m_out[5] = (file_size >> 8) & 255;
+  m_out[6] = (file_size >> 16) & 255;
+  m_out[7] = (file_size >> 24) & 255;
 }
 
 void Encoder::EncodeHeader(int width,
                            int height,
                            int num_channels) {
   const int header_size = 11;
-  m_packed_data.reserve(m_packed_data.size() + 8 + header_size);
-
-  m_packed_data.push_back('F');
-  m_packed_data.push_back('R');
-  m_packed_data.push_back('M');
-  m_packed_data.push_back('T');
-
-  m_packed_data.push_back(header_size & 255);
-  m_packed_data.push_back((header_size >> 8) & 255);
-  m_packed_data.push_back((header_size >> 16) & 255);
-  m_packed_data.push_back((header_size >> 24) & 255);
-
-  m_packed_data.push_back(1);  // Version
-  m_packed_data.push_back(width & 255);
-  m_packed_data.push_back((width >> 8) & 255);
-  m_packed_data.push_back((width >> 16) & 255);
-  m_packed_data.push_back((width >> 24) & 255);
-  m_packed_data.push_back(height & 255);
-  m_packed_data.push_back((height >> 8) & 255);
-  m_packed_data.push_back((height >> 16) & 255);
-  m_packed_data.push_back((height >> 24) & 255);
-  m_packed_data.push_back(num_channels);
-  m_packed_data.push_back(m_use_ycbcr ? 1 : 0);  // Color space (RGB / YCbCr).
+  AppendByte('F');
+  AppendByte('R');
+  AppendByte('M');
+  AppendByte('T');
+
+  AppendByte(header_size & 255);
+  AppendByte((header_size >> 8) & 255);
+  AppendByte((header_size >> 16) & 255);
+  AppendByte((header_size >> 24) & 255);
+
+  AppendByte(2);  // Version
+  AppendByte(width & 255);
+  AppendByte((width >> 8) & 255);
+  AppendByte((width >> 16) & 255);
+  AppendByte((width >> 24) & 255);
+  AppendByte(height & 255);
+  AppendByte((height >> 8) & 255);
+  AppendByte((height >> 16) & 255);
+  AppendByte((height >> 24) & 255);
+  AppendByte(num_channels);
+  AppendByte(m_use_ycbcr ? 1 : 0);  // Color space (RGB / YCbCr).
 }
 
 void Encoder::EncodeLowResMappingFunction() {
   // Store the mapping function in the output buffer.
-  m_packed_data.push_back('L');
-  m_packed_data.push_back('M');
-  m_packed_data.push_back('A');
-  m_packed_data.push_back('P');
+  AppendByte('L');
+  AppendByte('M');
+  AppendByte('A');
+  AppendByte('P');
 
   int map_fun_size = m_low_res_mapper.MappingFunctionSize();
-  m_packed_data.push_back(map_fun_size & 255);
-  m_packed_data.push_back((map_fun_size >> 8) & 255);
-  m_packed_data.push_back((map_fun_size >> 16) & 255);
-  m_packed_data.push_back((map_fun_size >> 24) & 255);
-
-  int map_fun_base = static_cast<int>(m_packed_data.size());
-  m_packed_data.resize(map_fun_base + map_fun_size);
-  m_low_res_mapper.GetMappingFunction(&m_packed_data[map_fun_base]);
+  AppendByte(map_fun_size & 255);
+  AppendByte((map_fun_size >> 8) & 255);
+  AppendByte((map_fun_size >> 16) & 255);
+  AppendByte((map_fun_size >> 24) & 255);
+
+  m_low_res_mapper.GetMappingFunction(AppendSpace(map_fun_size));
 }
 
 void Encoder::EncodeLowRes(const uint8_t *data,
@@ -188,17 +416,34 @@ void Encoder::EncodeLowRes(const uint8_t *data,
                            int height,
                            int pixel_stride,
                            int num_channels) {
-  m_packed_data.push_back('L');
-  m_packed_data.push_back('R');
-  m_packed_data.push_back('E');
-  m_packed_data.push_back('S');
-
-  // Construct low-res (divided by 8x8) images for all channels.
-  for (int chan = 0; chan < num_channels; ++chan) {
-    m_downsampled.push_back(Downsampled());
-    Downsampled &downsampled = m_downsampled.back();
-    downsampled.SampleImage(data + chan, pixel_stride, width, height);
+  AppendByte('L');
+  AppendByte('R');
+  AppendByte('E');
+  AppendByte('S');
+
+  // Construct low-res (divided by 8x8) images for all channels. The image is
+  // converted to the color space of the encoded image one band of rows at a
+  // time.
+  m_downsampled.resize(num_channels);
+  for (int chan = 0; chan < num_channels; ++chan)
+    m_downsampled[chan].StartSampling(width, height);
+  std::vector<uint8_t> *band = &m_worker_scratch[0].band;
+  for (int v = 0; v < m_downsampled[0].rows(); ++v) {
+    int first_row, end_row;
+    Downsampled::SampledRows(v, height, &first_row, &end_row);
+    const uint8_t *rows = GetColorSpaceRows(
+        band, data, width, pixel_stride, num_channels, first_row, end_row);
+    Downsampled::SampleBlockRow(m_downsampled.data(),
+                                num_channels,
+                                rows,
+                                pixel_stride,
+                                width,
+                                height,
+                                v,
+                                &m_column_sums);
   }
+  for (int chan = 0; chan < num_channels; ++chan)
+    m_downsampled[chan].FinishSampling();
 
   // Prepare an unpacked buffer all channels.
   const int num_rows = (height + 7) >> 3;
@@ -206,149 +451,249 @@ void Encoder::EncodeLowRes(const uint8_t *data,
   const int channel_size =
       Downsampled::BlockDataSizePerChannel(num_rows, num_cols);
   const int unpacked_size = channel_size * num_channels;
-  std::vector<uint8_t> unpacked_data(unpacked_size);
-
-  // Get the low-res versions of the image fo all channels (delta encoded).
-  for (int chan = 0; chan < num_channels; ++chan) {
-    m_downsampled[chan].GetBlockData(unpacked_data.data() + chan * channel_size,
-                                     m_low_res_mapper);
-  }
-
-  // Compress data.
-  int packed_size = AppendPackedData(unpacked_data.data(), unpacked_size, 0);
+  m_unpacked_data.resize(unpacked_size);
+
+  // Get the low-res versions of the image fo all channels (delta encoded). The
+  // macro block rows of all channels are independent, so they are encoded in
+  // parallel.
+  const int macro_rows = Downsampled::NumMacroBlockRows(num_rows);
+  auto encode_macro_row = [this](int task, int) {
+    EncodeLowResMacroBlockRowTask(task);
+  };
+  m_executor->Run(num_channels * macro_rows, encode_macro_row);
+
+  // Compress data (one Huffman block per channel, so that the decoder can
+  // decode the channels in parallel).
+  int packed_size =
+      AppendPackedData(m_unpacked_data.data(), unpacked_size, channel_size);
   std::cout << "Low resolution data: " << packed_size << " bytes.\n";
 }
 
+void Encoder::EncodeLowResMacroBlockRowTask(int task) {
+  const int num_rows = (m_height + 7) >> 3;
+  const int channel_size = Downsampled::BlockDataSizePerChannel(
+      num_rows, (m_width + 7) >> 3);
+  const int macro_rows = Downsampled::NumMacroBlockRows(num_rows);
+  const int chan = task / macro_rows;
+  m_downsampled[chan].GetMacroBlockRow(
+      m_unpacked_data.data() + chan * channel_size,
+      task % macro_rows,
+      m_low_res_mapper);
+}
+
 void Encoder::EncodeQuantizationConfig() {
   // Store the quantization data in the output buffer.
-  m_packed_data.push_back('Q');
-  m_packed_data.push_back('C');
-  m_packed_data.push_back('F');
-  m_packed_data.push_back('G');
+  AppendByte('Q');
+  AppendByte('C');
+  AppendByte('F');
+  AppendByte('G');
 
   int config_size = m_quantize.ConfigurationSize();
-  m_packed_data.push_back(config_size & 255);
-  m_packed_data.push_back((config_size >> 8) & 255);
-  m_packed_data.push_back((config_size >> 16) & 255);
-  m_packed_data.push_back((config_size >> 24) & 255);
-
-  int quantization_config_base = static_cast<int>(m_packed_data.size());
-  m_packed_data.resize(quantization_config_base + config_size);
-  m_quantize.GetConfiguration(&m_packed_data[quantization_config_base]);
+  AppendByte(config_size & 255);
+  AppendByte((config_size >> 8) & 255);
+  AppendByte((config_size >> 16) & 255);
+  AppendByte((config_size >> 24) & 255);
+
+  m_quantize.GetConfiguration(AppendSpace(config_size));
 }
 
 void Encoder::EncodeFullResMappingFunction() {
   // Store the mapping function in the output buffer.
-  m_packed_data.push_back('F');
-  m_packed_data.push_back('M');
-  m_packed_data.push_back('A');
-  m_packed_data.push_back('P');
+  AppendByte('F');
+  AppendByte('M');
+  AppendByte('A');
+  AppendByte('P');
 
   int map_fun_size = m_full_res_mapper.MappingFunctionSize();
-  m_packed_data.push_back(map_fun_size & 255);
-  m_packed_data.push_back((map_fun_size >> 8) & 255);
-  m_packed_data.push_back((map_fun_size >> 16) & 255);
-  m_packed_data.push_back((map_fun_size >> 24) & 255);
-
-  int map_fun_base = static_cast<int>(m_packed_data.size());
-  m_packed_data.resize(map_fun_base + map_fun_size);
-  m_full_res_mapper.GetMappingFunction(&m_packed_data[map_fun_base]);
+  AppendByte(map_fun_size & 255);
+  AppendByte((map_fun_size >> 8) & 255);
+  AppendByte((map_fun_size >> 16) & 255);
+  AppendByte((map_fun_size >> 24) & 255);
+
+  m_full_res_mapper.GetMappingFunction(AppendSpace(map_fun_size));
 }
 
-void Encoder::EncodeFullRes(const uint8_t *data,
-                            int width,
-                            int height,
-                            int pixel_stride,
-                            int num_channels) {
-  m_packed_data.push_back('F');
-  m_packed_data.push_back('R');
-  m_packed_data.push_back('E');
-  m_packed_data.push_back('S');
+void Encoder::EncodeFullRes(int width, int height, int num_channels) {
+  AppendByte('F');
+  AppendByte('R');
+  AppendByte('E');
+  AppendByte('S');
 
   // Prepare an unpacked buffer for all channels.
   const int num_blocks = ((width + 7) >> 3) * ((height + 7) >> 3);
   const int unpacked_size = num_blocks * 64 * num_channels;
-  std::vector<uint8_t> unpacked_data(unpacked_size);
+  m_unpacked_data.resize(unpacked_size);
+
+  // Prepare the working memory for all workers (each worker converts the rows
+  // of a block row to the color space of the encoded image in its own band
+  // buffer).
+  const int block_row_size = ((width + 7) >> 3) * 64 * num_channels;
+  for (auto &scratch : m_worker_scratch) {
+    if (m_use_ycbcr)
+      scratch.band.reserve(8 * width * m_pixel_stride);
+    scratch.lowres_band.resize(block_row_size);
+    scratch.blocks.resize(64 * num_channels);
+  }
 
-  // Process all the 8x8 blocks.
-  int unpacked_idx = 0;
-  for (int y = 0; y < height; y += 8) {
-    // Vertical block coordinate (v).
-    int v = y >> 3;
+  // Process all the 8x8 blocks, one row at a time or several rows in parallel.
+  auto encode_row = [this](int v, int worker) {
+    EncodeFullResBlockRowTask(v, worker);
+  };
+  m_executor->Run((height + 7) >> 3, encode_row);
 
-    // Interleave all channels per block row.
-    for (int chan = 0; chan < num_channels; ++chan) {
-      // Get the low-res (divided by 8x8) image for this channel.
-      Downsampled &downsampled = m_downsampled[chan];
+  // Compress all channels.
+  int packed_size = AppendPackedData(
+      m_unpacked_data.data(), unpacked_size, block_row_size);
+  std::cout << "Full resolution data: " << packed_size << " bytes.\n";
+}
 
-      bool is_chroma_channel = m_use_ycbcr && (chan == 1 || chan == 2);
+void Encoder::EncodeFullResBlockRowTask(int v, int worker) {
+  WorkerScratch &scratch = m_worker_scratch[worker];
+  const int y = v << 3;
+  const uint8_t *rows = GetColorSpaceRows(&scratch.band,
+                                          m_data,
+                                          m_width,
+                                          m_pixel_stride,
+                                          m_num_channels,
+                                          y,
+                                          std::min(y + 8, m_height));
+  const int block_row_size = ((m_width + 7) >> 3) * 64 * m_num_channels;
+  EncodeFullResBlockRow(m_unpacked_data.data() + v * block_row_size,
+                        scratch.lowres_band.data(),
+                        scratch.blocks.data(),
+                        rows,
+                        m_width,
+                        m_height,
+                        m_pixel_stride,
+                        m_num_channels,
+                        y);
+}
+
+const uint8_t *Encoder::GetColorSpaceRows(std::vector<uint8_t> *band,
+                                          const uint8_t *data,
+                                          int width,
+                                          int pixel_stride,
+                                          int num_channels,
+                                          int first_row,
+                                          int end_row) const {
+  // Get the image rows [first_row, end_row) in the color space of the encoded
+  // image (converted into the band buffer if necessary).
+  const uint8_t *rows = data + first_row * width * pixel_stride;
+  if (!m_use_ycbcr)
+    return rows;
+
+  // Convert the rows to YCbCr.
+  const int num_rows = end_row - first_row;
+  band->resize(num_rows * width * pixel_stride);
+  YCbCr::RGBToYCbCr(
+      band->data(), rows, width, num_rows, pixel_stride, num_channels);
+  return band->data();
+}
+
+void Encoder::EncodeFullResBlockRow(uint8_t *out,
+                                    int16_t *lowres_band,
+                                    int16_t *blocks,
+                                    const uint8_t *rows,
+                                    int width,
+                                    int height,
+                                    int pixel_stride,
+                                    int num_channels,
+                                    int y) {
+  // Note: rows points at the first image row of this block row.
+
+  // Vertical block coordinate (v).
+  int v = y >> 3;
+
+  // Get the low-res component of the whole block row, for all channels (the
+  // low-res band of channel k is channel_size values after that of channel
+  // k - 1).
+  const int columns = (width + 7) >> 3;
+  const int channel_size = columns * 64;
+  const int lowres_stride = columns * 8;
+  for (int chan = 0; chan < num_channels; ++chan) {
+    m_downsampled[chan].GetLowresBlockRow(
+        lowres_band + chan * channel_size, lowres_stride, v, 0, columns);
+  }
 
-      for (int x = 0; x < width; x += 8) {
-        // Horizontal block coordinate (u).
-        int u = x >> 3;
-
-        // Size of this block (usually 8x8, but smaller around the edges).
-        int block_width = std::min(8, width - x);
-        int block_height = std::min(8, height - y);
-
-        // Copy color channel from source data.
-        int16_t buf0[64];
-        ExtractChannelBlock(buf0,
-                            &data[(y * width + x) * pixel_stride],
-                            chan,
-                            pixel_stride,
-                            width * pixel_stride,
-                            block_width,
-                            block_height);
-
-        // Remove low-res component.
-        int16_t lowres[64];
-        downsampled.GetLowresBlock(lowres, u, v);
-        for (int i = 0; i < 64; ++i) {
-          buf0[i] -= lowres[i];
-        }
-
-        // Forward transform.
-        int16_t buf1[64];
-        Hadamard::Forward(buf1, buf0);
-
-        // Quantize.
-        uint8_t packed[64];
-        m_quantize.Pack(packed, buf1, is_chroma_channel, m_full_res_mapper);
-
-        // Store quantized data in the unpacked buffer.
-        for (int i = 0; i < 64; ++i) {
-          unpacked_data[unpacked_idx + u + i * downsampled.columns()] =
-              packed[kIndexLUT[i]];
-        }
+  for (int x = 0; x < width; x += 8) {
+    // Horizontal block coordinate (u).
+    int u = x >> 3;
+
+    // Size of this block (usually 8x8, but smaller around the edges).
+    int block_width = std::min(8, width - x);
+    int block_height = std::min(8, height - y);
+
+    // Copy all the color channels of the block from the source data.
+    ExtractPixelBlock(blocks,
+                      &rows[x * pixel_stride],
+                      num_channels,
+                      pixel_stride,
+                      width * pixel_stride,
+                      block_width,
+                      block_height);
+
+    // Encode the block of each channel (the channels are stored one after the
+    // other in each block row).
+    for (int chan = 0; chan < num_channels; ++chan) {
+      bool is_chroma_channel = m_use_ycbcr && (chan == 1 || chan == 2);
+      int16_t *buf0 = blocks + chan * 64;
+
+      // Remove low-res component.
+      const int16_t *lowres_line = lowres_band + chan * channel_size + x;
+      for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j)
+          buf0[i * 8 + j] -= lowres_line[j];
+        lowres_line += lowres_stride;
       }
 
-      unpacked_idx += downsampled.columns() * 64;
+      // Forward transform.
+      int16_t buf1[64];
+      Hadamard::Forward(buf1, buf0);
+
+      // Quantize.
+      uint8_t packed[64];
+      m_quantize.Pack(packed, buf1, is_chroma_channel, m_full_res_mapper);
+
+      // Store quantized data in the unpacked buffer.
+      uint8_t *channel_out = out + chan * channel_size;
+      for (int i = 0; i < 64; ++i) {
+        channel_out[u + i * columns] = packed[kIndexLUT[i]];
+      }
     }
   }
+}
 
-  // Compress all channels.
-  int block_size = m_downsampled[0].columns() * num_channels * 64;
-  int packed_size = AppendPackedData(
-      unpacked_data.data(), unpacked_size, block_size);
-  std::cout << "Full resolution data: " << packed_size << " bytes.\n";
+void Encoder::GrowPackedData(int size) {
+  // Only the internal buffer grows (a caller provided buffer is large enough).
+  // The new buffer is not initialized, so the memory that is never written to
+  // (e.g. the unused part of the room for the compressed data) is not touched.
+  const int64_t new_capacity =
+      std::min<int64_t>(std::max<int64_t>(int64_t(m_out_size) + size,
+                                          int64_t(m_packed_capacity) * 2),
+                        std::numeric_limits<int>::max());
+  std::unique_ptr<uint8_t[]> new_data(
+      new uint8_t[static_cast<size_t>(new_capacity)]);
+  std::copy(m_out, m_out + m_out_size, new_data.get());
+  m_packed_data = std::move(new_data);
+  m_packed_capacity = static_cast<int>(new_capacity);
+  m_out = m_packed_data.get();
+  m_out_capacity = m_packed_capacity;
 }
 
 int Encoder::AppendPackedData(
     const uint8_t *unpacked_data, int unpacked_size, int block_size) {
-  const int packed_base_idx = static_cast<int>(m_packed_data.size());
-  m_packed_data.resize(packed_base_idx + 4 +
-                       HuffmanEnc::MaxCompressedSize(unpacked_size));
-  int packed_size =
-      HuffmanEnc::Compress(m_packed_data.data() + packed_base_idx + 4,
-                           unpacked_data,
-                           unpacked_size,
-                           block_size);
-  m_packed_data[packed_base_idx] = packed_size & 255;
-  m_packed_data[packed_base_idx + 1] = (packed_size >> 8) & 255;
-  m_packed_data[packed_base_idx + 2] = (packed_size >> 16) & 255;
-  m_packed_data[packed_base_idx + 3] = (packed_size >> 24) & 255;
-  m_packed_data.resize(packed_base_idx + 4 + packed_size);
+  // Make room for the size and the compressed data, which is compressed
+  // straight into the output buffer.
+  ReserveSpace(4 + static_cast<int>(HuffmanEnc::MaxCompressedSize(
+                       unpacked_size, block_size)));
+  uint8_t *size_ptr = AppendSpace(4);
+  int packed_size = HuffmanEnc::Compress(
+      m_out + m_out_size, unpacked_data, unpacked_size, block_size);
+  size_ptr[0] = packed_size & 255;
+  size_ptr[1] = (packed_size >> 8) & 255;
+  size_ptr[2] = (packed_size >> 16) & 255;
+  size_ptr[3] = (packed_size >> 24) & 255;
+  m_out_size += packed_size;
   return packed_size;
 }
 
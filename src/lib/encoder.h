@@ -10,17 +10,30 @@
 #define ENCODER_H_
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "downsampled.h"
+#include "executor.h"
 #include "quantize.h"
+#include "thread_pool.h"
 
 namespace himg {
 
 class Encoder {
  public:
-  Encoder();
+  // The encoder keeps a pool of max_threads worker threads (0 = one thread per
+  // hardware thread) for its entire lifetime.
+  Encoder(int max_threads = 0,
+          const ThreadPool::Config &pool_config = ThreadPool::Config());
 
+  // Run all parallel work on an external executor (not owned by the encoder).
+  explicit Encoder(Executor *executor);
+
+  // Encode an image. The encoded data is available from packed_data() and
+  // packed_size() until the next call. The encoder keeps its working memory
+  // (and the output buffer) between calls, so it is cheap to reuse the same
+  // encoder for many images.
   bool Encode(const uint8_t *data,
               int width,
               int height,
@@ -29,11 +42,51 @@ class Encoder {
               int quality,
               bool use_ycbcr);
 
-  const uint8_t *packed_data() const { return m_packed_data.data(); }
+  // Encode an image straight into a caller provided buffer of out_capacity
+  // bytes, which must be at least MaxEncodedSize() bytes. On success, the size
+  // of the encoded data is stored in *out_size.
+  bool Encode(const uint8_t *data,
+              int width,
+              int height,
+              int pixel_stride,
+              int num_channels,
+              int quality,
+              bool use_ycbcr,
+              uint8_t *out,
+              int out_capacity,
+              int *out_size);
+
+  // Get an upper bound for the size of an encoded image. Images whose bound
+  // does not fit in an int can not be encoded.
+  static int64_t MaxEncodedSize(int width, int height, int num_channels);
+
+  const uint8_t *packed_data() const { return m_packed_data.get(); }
 
-  int packed_size() const { return static_cast<int>(m_packed_data.size()); }
+  int packed_size() const { return m_packed_size; }
 
  private:
+  // Working memory for each worker.
+  struct WorkerScratch {
+    // One block row (or one sampled band) of pixels in the color space of the
+    // encoded image.
+    std::vector<uint8_t> band;
+
+    // The low-res component of one block row, for all channels.
+    std::vector<int16_t> lowres_band;
+
+    // The pixel blocks of all channels.
+    std::vector<int16_t> blocks;
+  };
+
+  void EncodeImage(const uint8_t *data,
+                   int width,
+                   int height,
+                   int pixel_stride,
+                   int num_channels,
+                   int quality,
+                   bool use_ycbcr,
+                   uint8_t *out,
+                   int out_capacity);
   void EncodeRIFFStart();
   void UpdateRIFFStart();
   void EncodeHeader(int width, int height, int num_channels);
@@ -43,24 +96,80 @@ class Encoder {
                     int height,
                     int pixel_stride,
                     int num_channels);
+  void EncodeLowResMacroBlockRowTask(int task);
   void EncodeQuantizationConfig();
   void EncodeFullResMappingFunction();
-  void EncodeFullRes(const uint8_t *data,
-                     int width,
-                     int height,
-                     int pixel_stride,
-                     int num_channels);
+  void EncodeFullRes(int width, int height, int num_channels);
+  const uint8_t *GetColorSpaceRows(std::vector<uint8_t> *band,
+                                   const uint8_t *data,
+                                   int width,
+                                   int pixel_stride,
+                                   int num_channels,
+                                   int first_row,
+                                   int end_row) const;
+  void EncodeFullResBlockRowTask(int v, int worker);
+  void EncodeFullResBlockRow(uint8_t *out,
+                             int16_t *lowres_band,
+                             int16_t *blocks,
+                             const uint8_t *rows,
+                             int width,
+                             int height,
+                             int pixel_stride,
+                             int num_channels,
+                             int y);
 
   int AppendPackedData(
       const uint8_t *unpacked_data, int unpacked_size, int block_size);
 
+  // Make room for size more bytes in the output buffer.
+  void ReserveSpace(int size) {
+    if (size > m_out_capacity - m_out_size)
+      GrowPackedData(size);
+  }
+  void GrowPackedData(int size);
+
+  void AppendByte(uint8_t x) {
+    ReserveSpace(1);
+    m_out[m_out_size++] = x;
+  }
+
+  uint8_t *AppendSpace(int size) {
+    ReserveSpace(size);
+    uint8_t *space = m_out + m_out_size;
+    m_out_size += size;
+    return space;
+  }
+
+  std::unique_ptr<ThreadPool> m_thread_pool;
+  Executor *m_executor;
+  std::vector<WorkerScratch> m_worker_scratch;
+
+  // The image that is being encoded (for the parallel tasks).
+  const uint8_t *m_data;
+  int m_width;
+  int m_height;
+  int m_pixel_stride;
+  int m_num_channels;
+
+  // The encoded data is written to m_out, which has room for m_out_capacity
+  // bytes, and m_out_size is the size of the data so far. A caller provided
+  // buffer has room for at least MaxEncodedSize() bytes, while the internal
+  // buffer (m_packed_data) grows when needed.
+  uint8_t *m_out;
+  int m_out_capacity;
+  int m_out_size;
+
   int m_quality;
   bool m_use_ycbcr;
   Quantize m_quantize;
   LowResMapper m_low_res_mapper;
   FullResMapper m_full_res_mapper;
   std::vector<Downsampled> m_downsampled;
-  std::vector<uint8_t> m_packed_data;
+  std::vector<uint16_t> m_column_sums;
+  std::vector<uint8_t> m_unpacked_data;
+  std::unique_ptr<uint8_t[]> m_packed_data;
+  int m_packed_capacity;
+  int m_packed_size;
 };
 
 }  // namespace himg
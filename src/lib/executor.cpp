@@ -0,0 +1,35 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "executor.h"
+
+#include <condition_variable>
+#include <mutex>
+
+namespace himg {
+
+Executor::~Executor() {
+}
+
+void Executor::Run(int num_tasks, const Task &task) {
+  std::mutex mutex;
+  std::condition_variable done_cond;
+  bool done = false;
+
+  Submit(num_tasks, task, [&mutex, &done_cond, &done]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    done_cond.notify_one();
+  });
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!done)
+    done_cond.wait(lock);
+}
+
+}  // namespace himg
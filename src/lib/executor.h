@@ -0,0 +1,47 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+#include <functional>
+
+namespace himg {
+
+// An executor runs jobs that consist of a number of independent tasks (e.g. one
+// task per block row). Implement this interface to run the encoder and decoder
+// on an existing task scheduler. The default implementation is ThreadPool.
+class Executor {
+ public:
+  // A task function is called with the task number (0 to num_tasks - 1) and the
+  // number of the worker that runs the task (0 to num_workers() - 1). Two tasks
+  // of the same job never run concurrently with the same worker number.
+  typedef std::function<void(int, int)> Task;
+
+  // A completion function is called once all the tasks of a job have finished.
+  typedef std::function<void()> Completion;
+
+  virtual ~Executor();
+
+  // The maximum number of workers that run tasks concurrently.
+  virtual int num_workers() const = 0;
+
+  // Start running a job without waiting for it to finish. The completion
+  // function may be called from any thread.
+  virtual void Submit(int num_tasks,
+                      const Task &task,
+                      const Completion &on_complete) = 0;
+
+  // Run a job and wait for it to finish. The default implementation calls
+  // Submit() and blocks until the completion function has been called.
+  virtual void Run(int num_tasks, const Task &task);
+};
+
+}  // namespace himg
+
+#endif  // EXECUTOR_H_
@@ -73,6 +73,31 @@ void Inverse8(int16_t *out, const int16_t *in) {
   out[7 * STRIDE] = static_cast<int16_t>((b0 - b1) >> SHIFT);
 }
 
+// Four point inverse Hadamard transform of the four lowest frequency
+// coefficients (equal to the pairwise average of the eight point transform).
+template <int STRIDE, int SHIFT>
+void Inverse4(int16_t *out, const int16_t *in) {
+  int32_t a0 = in[0 * STRIDE] + in[1 * STRIDE];
+  int32_t a1 = in[0 * STRIDE] - in[1 * STRIDE];
+  int32_t a2 = in[2 * STRIDE] + in[3 * STRIDE];
+  int32_t a3 = in[2 * STRIDE] - in[3 * STRIDE];
+  out[0 * STRIDE] = static_cast<int16_t>((a0 + a2) >> SHIFT);
+  out[1 * STRIDE] = static_cast<int16_t>((a0 - a2) >> SHIFT);
+  out[2 * STRIDE] = static_cast<int16_t>((a1 - a3) >> SHIFT);
+  out[3 * STRIDE] = static_cast<int16_t>((a1 + a3) >> SHIFT);
+}
+
+// Two point inverse Hadamard transform of the two lowest frequency
+// coefficients (equal to the average of four points of the eight point
+// transform).
+template <int STRIDE, int SHIFT>
+void Inverse2(int16_t *out, const int16_t *in) {
+  int32_t a0 = in[0 * STRIDE] + in[1 * STRIDE];
+  int32_t a1 = in[0 * STRIDE] - in[1 * STRIDE];
+  out[0 * STRIDE] = static_cast<int16_t>(a0 >> SHIFT);
+  out[1 * STRIDE] = static_cast<int16_t>(a1 >> SHIFT);
+}
+
 }  // namespace
 
 void Hadamard::Forward(int16_t *out, const int16_t *in) {
@@ -102,4 +127,20 @@ void Hadamard::Inverse(int16_t *out, const int16_t *in) {
   }
 }
 
+void Hadamard::InverseReduced(int16_t *out, const int16_t *in, int size) {
+  // Note: The scaling is the same as for the full transform, since the sum of
+  // N coefficients (one of 8 / N points) is divided by 8 in each dimension.
+  if (size == 4) {
+    for (int i = 0; i < 4; ++i)
+      Inverse4<1, 3>(&out[i * 8], &in[i * 8]);
+    for (int i = 0; i < 4; ++i)
+      Inverse4<8, 3>(&out[i], &out[i]);
+  } else {
+    for (int i = 0; i < 2; ++i)
+      Inverse2<1, 3>(&out[i * 8], &in[i * 8]);
+    for (int i = 0; i < 2; ++i)
+      Inverse2<8, 3>(&out[i], &out[i]);
+  }
+}
+
 }  // namespace himg
@@ -20,6 +20,12 @@ class Hadamard {
 
   // Inverse Hadamard transform, including divide by 64.
   static void Inverse(int16_t *out, const int16_t *in);
+
+  // Reduced inverse Hadamard transform, which only uses the size x size lowest
+  // frequency coefficients (size = 4 or 2). Each resulting pixel is the
+  // average of the corresponding 8/size x 8/size pixels of the full inverse
+  // transform. Both the input and the output have a row stride of eight.
+  static void InverseReduced(int16_t *out, const int16_t *in, int size);
 };
 
 }  // namespace himg
@@ -22,6 +22,13 @@ HuffmanDec::BitStream::BitStream(const uint8_t *buf, int size)
       m_read_failed(false) {
 }
 
+void HuffmanDec::BitStream::Init(const uint8_t *buf, int size) {
+  m_byte_ptr = buf;
+  m_bit_pos = 0;
+  m_end_ptr = buf + size;
+  m_read_failed = false;
+}
+
 HuffmanDec::BitStream::BitStream(const BitStream &other)
     : m_byte_ptr(other.m_byte_ptr),
       m_bit_pos(other.m_bit_pos),
@@ -110,15 +117,6 @@ uint8_t HuffmanDec::BitStream::Peek8Bits() const {
   return ((hi << 8) | lo) >> m_bit_pos;
 }
 
-uint32_t HuffmanDec::BitStream::Read16BitsAligned() {
-  // TODO(m): Check that we don't read past the end.
-
-  AlignToByte();
-  uint32_t lo = m_byte_ptr[0], hi = m_byte_ptr[1];
-  m_byte_ptr += 2;
-  return (hi << 8) | lo;
-}
-
 void HuffmanDec::BitStream::AlignToByte() {
   if (LIKELY(m_bit_pos)) {
     m_bit_pos = 0;
@@ -131,12 +129,6 @@ void HuffmanDec::BitStream::Advance(int N) {
   m_byte_ptr += new_bit_pos >> 3;
 }
 
-void HuffmanDec::BitStream::AdvanceBytes(int N) {
-  // TODO(m): Check that we don't read past the end.
-
-  m_byte_ptr += N;
-}
-
 bool HuffmanDec::BitStream::AtTheEnd() const {
   // This is a rought estimate that we have reached the end of the input
   // buffer (not too short, and not too far).
@@ -212,16 +204,18 @@ HuffmanDec::DecodeNode *HuffmanDec::RecoverTree(int *nodenum,
   return this_node;
 }
 
-HuffmanDec::HuffmanDec(const uint8_t *in, int in_size, int block_size)
-    : m_stream(in, in_size), m_root(nullptr) {
-  m_block_size = block_size > 0 ? block_size : in_size;
-  m_use_blocks = m_block_size < in_size;
+HuffmanDec::HuffmanDec()
+    : m_stream(nullptr, 0),
+      m_root(nullptr),
+      m_in(nullptr),
+      m_next_block_ptr(nullptr),
+      m_use_blocks(false) {
 }
 
-bool HuffmanDec::Init() {
-  // Only allow Init() to run once.
-  if (m_root)
-    return false;
+bool HuffmanDec::Init(const uint8_t *in, int in_size, int block_size) {
+  m_stream.Init(in, in_size);
+  m_use_blocks = block_size > 0;
+  m_blocks.clear();
 
   // Recover Huffman tree.
   int node_count = 0;
@@ -231,23 +225,47 @@ bool HuffmanDec::Init() {
   m_stream.AlignToByte();
 
   // Recover the individual blocks.
-  if (m_use_blocks) {
-    BitStream tmp_stream(m_stream);
-    while (!tmp_stream.AtTheEnd()) {
-      // Read the packed size (two or four bytes).
-      uint32_t packed_block_size = tmp_stream.Read16BitsAligned();
-      if (packed_block_size & 0x8000) {
-        packed_block_size = (packed_block_size & 0x7fff) |
-                            (tmp_stream.Read16BitsAligned() << 15);
-      }
+  m_in = in;
+  m_next_block_ptr = m_stream.byte_ptr();
+  if (m_use_blocks)
+    FindBlocks(in + in_size);
+
+  return true;
+}
+
+void HuffmanDec::SetInputSize(int in_size) {
+  // Note: The stream is byte aligned after the tree.
+  const uint8_t *end = m_in + in_size;
+  m_stream.Init(m_stream.byte_ptr(),
+                static_cast<int>(end - m_stream.byte_ptr()));
+  if (m_use_blocks)
+    FindBlocks(end);
+}
 
-      // TODO(m): Check size of block stream.
-      m_blocks.push_back(BitStream(tmp_stream.byte_ptr(), packed_block_size));
-      tmp_stream.AdvanceBytes(packed_block_size);
+void HuffmanDec::FindBlocks(const uint8_t *end) {
+  // Only add blocks that are complete (i.e. that have all of their data before
+  // the end of the input).
+  const uint8_t *ptr = m_next_block_ptr;
+  while (end - ptr >= 2) {
+    // Read the packed size (two or four bytes).
+    int prefix_size = 2;
+    uint32_t packed_block_size =
+        static_cast<uint32_t>(ptr[0]) | (static_cast<uint32_t>(ptr[1]) << 8);
+    if (packed_block_size & 0x8000) {
+      if (end - ptr < 4)
+        break;
+      prefix_size = 4;
+      uint32_t hi =
+          static_cast<uint32_t>(ptr[2]) | (static_cast<uint32_t>(ptr[3]) << 8);
+      packed_block_size = (packed_block_size & 0x7fff) | (hi << 15);
     }
-  }
+    if (static_cast<uint32_t>(end - ptr - prefix_size) < packed_block_size)
+      break;
 
-  return true;
+    m_blocks.push_back(BitStream(ptr + prefix_size, packed_block_size));
+    ptr += prefix_size + packed_block_size;
+  }
+  m_next_block_ptr = ptr;
 }
 
 bool HuffmanDec::Uncompress(uint8_t *out, int out_size) const {
@@ -255,26 +273,49 @@ bool HuffmanDec::Uncompress(uint8_t *out, int out_size) const {
   if (!m_root || m_use_blocks)
     return false;
 
-  return UncompressStream(out, out_size, m_stream);
+  return UncompressStream(out, out_size, m_stream, false);
 }
 
 bool HuffmanDec::UncompressBlock(uint8_t *out,
                                  int out_size,
                                  int block_no) const {
   // Has Init() been run successfully?
-  if (!m_root || !m_use_blocks)
+  if (!m_root)
     return false;
 
-  if (block_no < 0 || block_no > static_cast<int>(m_blocks.size()))
+  // Data without blocks is treated as a single block.
+  if (!m_use_blocks)
+    return block_no == 0 && UncompressStream(out, out_size, m_stream, false);
+
+  if (block_no < 0 || block_no >= static_cast<int>(m_blocks.size()))
     return false;
 
-  return UncompressStream(out, out_size, m_blocks[block_no]);
+  return UncompressStream(out, out_size, m_blocks[block_no], false);
 }
 
-bool HuffmanDec::UncompressStream(
-    uint8_t *out, int out_size, BitStream stream) const {
+bool HuffmanDec::UncompressBlockPrefix(uint8_t *out,
+                                       int out_size,
+                                       int block_no) const {
+  // Has Init() been run successfully?
+  if (!m_root)
+    return false;
+
+  // Data without blocks is treated as a single block.
+  if (!m_use_blocks)
+    return block_no == 0 && UncompressStream(out, out_size, m_stream, true);
+
+  if (block_no < 0 || block_no >= static_cast<int>(m_blocks.size()))
+    return false;
+
+  return UncompressStream(out, out_size, m_blocks[block_no], true);
+}
+
+bool HuffmanDec::UncompressStream(uint8_t *out,
+                                  int out_size,
+                                  BitStream stream,
+                                  bool prefix_only) const {
   // Do we have anything to decompress?
-  if (m_stream.AtTheEnd())
+  if (stream.AtTheEnd())
     return out_size == 0;
 
   // Decode input stream.
@@ -350,8 +391,12 @@ bool HuffmanDec::UncompressStream(
         }
       }
 
-      if (UNLIKELY(buf + zero_count > buf_end))
-        return false;
+      if (UNLIKELY(buf + zero_count > buf_end)) {
+        // A zero run may continue past the end of a prefix.
+        if (!prefix_only)
+          return false;
+        zero_count = static_cast<int>(buf_end - buf);
+      }
       std::fill(buf, buf + zero_count, 0);
       buf += zero_count;
     }
@@ -407,14 +452,20 @@ bool HuffmanDec::UncompressStream(
         }
       }
 
-      if (UNLIKELY(stream.read_failed() || buf + zero_count > buf_end))
+      if (UNLIKELY(stream.read_failed()))
         return false;
+      if (UNLIKELY(buf + zero_count > buf_end)) {
+        if (!prefix_only)
+          return false;
+        zero_count = static_cast<int>(buf_end - buf);
+      }
       std::fill(buf, buf + zero_count, 0);
       buf += zero_count;
     }
   }
 
-  return stream.AtTheEnd();
+  // Unless only a prefix was requested, all the data must have been used.
+  return prefix_only || stream.AtTheEnd();
 }
 
 }  // namespace himg
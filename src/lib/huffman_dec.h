@@ -16,10 +16,25 @@ namespace himg {
 
 class HuffmanDec {
  public:
-  HuffmanDec(const uint8_t *in, int in_size, int block_size);
-
-  // Decode the Huffman data preamble (the tree).
-  bool Init();
+  HuffmanDec();
+
+  // Decode the Huffman data preamble (the tree). If block_size is non-zero, the
+  // data consists of independent blocks that hold block_size bytes each when
+  // uncompressed. The decoder can be initialized several times, and memory is
+  // reused between initializations.
+  //
+  // For incremental decoding, in_size may be smaller than the size of the
+  // data, as long as it covers the tree (Init() fails otherwise). Only the
+  // blocks that are complete within in_size bytes can be uncompressed, until
+  // more data is made available with SetInputSize().
+  bool Init(const uint8_t *in, int in_size, int block_size);
+
+  // Make in_size bytes of input data available (counted from the start of the
+  // data that was given to Init()), and find any new complete blocks.
+  void SetInputSize(int in_size);
+
+  // The number of complete blocks that have been found so far.
+  int num_blocks() const { return static_cast<int>(m_blocks.size()); }
 
   // Uncompress the Huffman stream (requires that Init() has been called first).
   bool Uncompress(uint8_t *out, int out_size) const;
@@ -28,6 +43,10 @@ class HuffmanDec {
   // been called first).
   bool UncompressBlock(uint8_t *out, int out_size, int block_no) const;
 
+  // Uncompress the first out_size bytes of a block, without decoding the rest
+  // of the block.
+  bool UncompressBlockPrefix(uint8_t *out, int out_size, int block_no) const;
+
  private:
   // The maximum number of tree nodes.
   static const int kMaxTreeNodes = (261 * 2) - 1;
@@ -41,6 +60,9 @@ class HuffmanDec {
     // Copy constructor.
     BitStream(const BitStream &other);
 
+    // Re-initialize the bitstream with a new buffer.
+    void Init(const uint8_t *buf, int size);
+
     // Read one bit from a bitstream.
     int ReadBit();
 
@@ -56,18 +78,12 @@ class HuffmanDec {
     // Peek eight bits from a bitstream (read without advancing the pointer).
     uint8_t Peek8Bits() const;
 
-    // Read 16 bits from a bitstream, byte aligned.
-    uint32_t Read16BitsAligned();
-
     // Align the stream to a byte boundary (do nothing if already aligned).
     void AlignToByte();
 
     // Advance the pointer by N bits.
     void Advance(int N);
 
-    // Advance N bytes.
-    void AdvanceBytes(int N);
-
     // Check if we have reached the end of the buffer.
     bool AtTheEnd() const;
 
@@ -98,7 +114,11 @@ class HuffmanDec {
 
   DecodeNode *RecoverTree(int *nodenum, uint32_t code, int bits);
 
-  bool UncompressStream(uint8_t *out, int out_size, BitStream stream) const;
+  bool UncompressStream(uint8_t *out,
+                        int out_size,
+                        BitStream stream,
+                        bool prefix_only) const;
+  void FindBlocks(const uint8_t *end);
 
   DecodeNode m_nodes[kMaxTreeNodes];
   DecodeLutEntry m_decode_lut[256];
@@ -106,8 +126,9 @@ class HuffmanDec {
   BitStream m_stream;
   DecodeNode *m_root;
 
+  const uint8_t *m_in;
+  const uint8_t *m_next_block_ptr;
   std::vector<BitStream> m_blocks;
-  int m_block_size;
   bool m_use_blocks;
 };
 
@@ -8,8 +8,7 @@
 
 #include "huffman_enc.h"
 
-#include <algorithm>
-#include <vector>
+#include <cstring>
 
 #include "huffman_common.h"
 
@@ -35,8 +34,12 @@ class OutBitstream {
 
     // Append bits.
     // TODO(m): Optimize this!
+    // Note: Each byte is cleared when the first bit is written to it, so the
+    // output buffer does not have to be initialized.
     while (bits--) {
-      *buf = (*buf & (0xff ^ (1 << bit))) | ((x & 1) << bit);
+      if (!bit)
+        *buf = 0;
+      *buf |= static_cast<uint8_t>((x & 1) << bit);
       x >>= 1;
       bit = (bit + 1) & 7;
       if (!bit) {
@@ -239,8 +242,26 @@ void MakeTree(SymbolInfo *sym, OutBitstream *stream) {
 
 }  // namespace
 
-int HuffmanEnc::MaxCompressedSize(int uncompressed_size) {
-  return uncompressed_size + kMaxTreeDataSize;
+int64_t HuffmanEnc::MaxCompressedSize(int64_t uncompressed_size,
+                                      int64_t block_size) {
+  if (block_size < 1 || block_size > uncompressed_size)
+    block_size = uncompressed_size;
+  const int64_t num_blocks =
+      block_size > 0 ? uncompressed_size / block_size : 0;
+
+  // Single codes may be longer than nine bits, but the Huffman code is optimal
+  // for the symbol counts of the data (the tree is not depth limited), so the
+  // codes of all the symbols together are never longer than with a fixed
+  // length code of nine bits per symbol (kNumSymbols <= 512). With such a
+  // code, a symbol and its extra bits take at most nine bits per byte that it
+  // represents (e.g. an RLE symbol for 3 - 6 zeros takes 9 + 2 bits), so the
+  // data of all the blocks is at most nine bits per uncompressed byte in
+  // total. Each block is padded to a whole byte, and is preceded by its size
+  // (up to four bytes) when there are several blocks.
+  const int64_t max_data_bits = 9 * uncompressed_size;
+  const int64_t block_overhead = num_blocks > 1 ? 5 : 1;
+  return kMaxTreeDataSize + num_blocks * block_overhead +
+         (max_data_bits + 7) / 8;
 }
 
 int HuffmanEnc::Compress(uint8_t *out,
@@ -285,13 +306,14 @@ int HuffmanEnc::Compress(uint8_t *out,
     }
   } while (swaps);
 
-  std::vector<uint8_t> block_buffer(block_size);
-
   // Encode input stream.
   const uint8_t *in_end = in + in_size;
   for (const uint8_t *block = in; block < in_end; block += block_size) {
-    // Create a temporary output stream for this block.
-    OutBitstream block_stream(block_buffer.data());
+    // Each block is encoded straight into the output stream. When there are
+    // several blocks, room is left for the largest (four byte) size prefix.
+    stream.AlignToByte();
+    uint8_t *block_start = stream.byte_ptr();
+    OutBitstream block_stream(block_start + (use_blocks ? 4 : 0));
 
     // Encode this block.
     for (int k = 0; k < block_size;) {
@@ -341,9 +363,10 @@ int HuffmanEnc::Compress(uint8_t *out,
 
     if (use_blocks) {
       // Write the packed size (in bytes) as two or four bytes (depending on the
-      // size).
-      stream.AlignToByte();
+      // size). With a two byte size, the block data is moved down to follow
+      // right after it.
       if (packed_size <= 0x7fff) {
+        std::memmove(block_start + 2, block_start + 4, packed_size);
         stream.WriteBits(packed_size, 16);
       } else {
         stream.WriteBits((packed_size & 0x7fff) | 0x8000, 16);
@@ -352,9 +375,6 @@ int HuffmanEnc::Compress(uint8_t *out,
     }
 
     // Append the block stream to the output stream.
-    std::copy(block_buffer.data(),
-              block_buffer.data() + packed_size,
-              stream.byte_ptr());
     stream.AdvanceBytes(packed_size);
   }
 
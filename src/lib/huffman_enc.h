@@ -15,7 +15,11 @@ namespace himg {
 
 class HuffmanEnc {
  public:
-  static int MaxCompressedSize(int uncompressed_size);
+  // Get the maximum size of the compressed data for uncompressed_size bytes
+  // of input that is compressed in blocks of block_size bytes (see Compress()).
+  // The sizes are 64-bit, since the bound is larger than the uncompressed size.
+  static int64_t MaxCompressedSize(int64_t uncompressed_size,
+                                   int64_t block_size = 0);
 
   static int Compress(uint8_t *out,
                       const uint8_t *in,
@@ -0,0 +1,291 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "pixel_format.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace himg {
+
+namespace {
+
+// Calculate x * a / 255, correctly rounded (x and a are in the range 0-255).
+inline uint8_t MulDiv255(int x, int a) {
+  int t = x * a + 128;
+  return static_cast<uint8_t>((t + (t >> 8)) >> 8);
+}
+
+// Read the R, G, B and A components of a pixel with N channels.
+template <int N>
+inline void LoadRGBA(const uint8_t *in, int *r, int *g, int *b, int *a) {
+  if (N >= 3) {
+    *r = in[0];
+    *g = in[1];
+    *b = in[2];
+  } else {
+    *r = *g = *b = in[0];
+  }
+  *a = (N == 2 || N == 4) ? in[N - 1] : 255;
+}
+
+// Store four-channel pixels as four-channel pixels. This is the common case
+// (e.g. RGBA -> BGRA), so it has a SIMD implementation.
+void StoreRGBAToRGBA(uint8_t *out,
+                     const uint8_t *in,
+                     int width,
+                     bool swap_rb,
+                     bool opaque,
+                     bool premultiply_alpha) {
+  int x = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rounding = _mm_set1_epi16(128);
+  const __m128i color_mask16 = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+  const __m128i alpha_one16 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+  const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+  const __m128i alpha_mask = _mm_set1_epi32(static_cast<int>(0xff000000));
+  for (; x + 4 <= width; x += 4) {
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+
+    if (premultiply_alpha) {
+      // Work on two pixels (eight 16-bit components) at a time. The alpha
+      // component is multiplied by 255/255, i.e. it is left unchanged.
+      __m128i lo = _mm_unpacklo_epi8(p, zero);
+      __m128i hi = _mm_unpackhi_epi8(p, zero);
+      __m128i a_lo = _mm_shufflehi_epi16(
+          _mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)),
+          _MM_SHUFFLE(3, 3, 3, 3));
+      __m128i a_hi = _mm_shufflehi_epi16(
+          _mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)),
+          _MM_SHUFFLE(3, 3, 3, 3));
+      a_lo = _mm_or_si128(_mm_and_si128(a_lo, color_mask16), alpha_one16);
+      a_hi = _mm_or_si128(_mm_and_si128(a_hi, color_mask16), alpha_one16);
+      lo = _mm_add_epi16(_mm_mullo_epi16(lo, a_lo), rounding);
+      hi = _mm_add_epi16(_mm_mullo_epi16(hi, a_hi), rounding);
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+      p = _mm_packus_epi16(lo, hi);
+    }
+
+    if (swap_rb) {
+      __m128i rb = _mm_and_si128(p, rb_mask);
+      rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+      p = _mm_or_si128(_mm_andnot_si128(rb_mask, p), rb);
+    }
+
+    if (opaque)
+      p = _mm_or_si128(p, alpha_mask);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), p);
+    in += 16;
+    out += 16;
+  }
+#endif
+
+  for (; x < width; ++x) {
+    int r = in[0], g = in[1], b = in[2], a = in[3];
+    if (premultiply_alpha) {
+      r = MulDiv255(r, a);
+      g = MulDiv255(g, a);
+      b = MulDiv255(b, a);
+    }
+    out[0] = static_cast<uint8_t>(swap_rb ? b : r);
+    out[1] = static_cast<uint8_t>(g);
+    out[2] = static_cast<uint8_t>(swap_rb ? r : b);
+    out[3] = static_cast<uint8_t>(opaque ? 255 : a);
+    in += 4;
+    out += 4;
+  }
+}
+
+// Expand pixels with one to three channels to four-channel pixels.
+template <int N>
+void ExpandToRGBA(uint8_t *out,
+                  const uint8_t *in,
+                  int width,
+                  bool swap_rb,
+                  bool opaque,
+                  bool premultiply_alpha) {
+  for (int x = 0; x < width; ++x) {
+    int r, g, b, a;
+    LoadRGBA<N>(in, &r, &g, &b, &a);
+    if (opaque) {
+      a = 255;
+    } else if (premultiply_alpha) {
+      r = MulDiv255(r, a);
+      g = MulDiv255(g, a);
+      b = MulDiv255(b, a);
+    }
+    out[0] = static_cast<uint8_t>(swap_rb ? b : r);
+    out[1] = static_cast<uint8_t>(g);
+    out[2] = static_cast<uint8_t>(swap_rb ? r : b);
+    out[3] = static_cast<uint8_t>(a);
+    in += N;
+    out += 4;
+  }
+}
+
+template <int N>
+void StoreRGB565(uint8_t *out, const uint8_t *in, int width) {
+  for (int x = 0; x < width; ++x) {
+    int r, g, b, a;
+    LoadRGBA<N>(in, &r, &g, &b, &a);
+    uint16_t rgb565 = static_cast<uint16_t>(((r >> 3) << 11) |
+                                            ((g >> 2) << 5) | (b >> 3));
+    out[0] = static_cast<uint8_t>(rgb565);
+    out[1] = static_cast<uint8_t>(rgb565 >> 8);
+    in += N;
+    out += 2;
+  }
+}
+
+template <int N>
+void StoreLuma(uint8_t *out, const uint8_t *in, int width) {
+  for (int x = 0; x < width; ++x) {
+    if (N >= 3)
+      out[x] = static_cast<uint8_t>((in[0] + 2 * in[1] + in[2] + 2) >> 2);
+    else
+      out[x] = in[0];
+    in += N;
+  }
+}
+
+template <int N>
+void StorePlanar(uint8_t *out, int plane_stride, const uint8_t *in, int width) {
+  for (int chan = 0; chan < N; ++chan) {
+    uint8_t *plane = out + chan * plane_stride;
+    for (int x = 0; x < width; ++x)
+      plane[x] = in[x * N + chan];
+  }
+}
+
+void StoreRGBA(uint8_t *out,
+               const uint8_t *in,
+               int width,
+               int num_channels,
+               bool swap_rb,
+               bool opaque,
+               bool premultiply_alpha) {
+  switch (num_channels) {
+    case 1:
+      ExpandToRGBA<1>(out, in, width, swap_rb, opaque, premultiply_alpha);
+      break;
+    case 2:
+      ExpandToRGBA<2>(out, in, width, swap_rb, opaque, premultiply_alpha);
+      break;
+    case 3:
+      ExpandToRGBA<3>(out, in, width, swap_rb, opaque, premultiply_alpha);
+      break;
+    default:
+      StoreRGBAToRGBA(out, in, width, swap_rb, opaque, premultiply_alpha);
+      break;
+  }
+}
+
+}  // namespace
+
+int PixelFormatConverter::BytesPerPixel(PixelFormat format, int num_channels) {
+  switch (format) {
+    case PixelFormat::kRGBA:
+    case PixelFormat::kBGRA:
+    case PixelFormat::kBGRX:
+      return 4;
+    case PixelFormat::kRGB565:
+      return 2;
+    case PixelFormat::kPlanar:
+    case PixelFormat::kPlanarYCbCr:
+    case PixelFormat::kLuma:
+      return 1;
+    default:
+      return num_channels;
+  }
+}
+
+int PixelFormatConverter::NumPlanes(PixelFormat format, int num_channels) {
+  if (format == PixelFormat::kPlanar || format == PixelFormat::kPlanarYCbCr)
+    return num_channels;
+  return 1;
+}
+
+void PixelFormatConverter::StoreRow(uint8_t *out,
+                                    int plane_stride,
+                                    const uint8_t *in,
+                                    int width,
+                                    int num_channels,
+                                    PixelFormat format,
+                                    bool premultiply_alpha) {
+  switch (format) {
+    case PixelFormat::kRGBA:
+      StoreRGBA(out, in, width, num_channels, false, false, premultiply_alpha);
+      break;
+    case PixelFormat::kBGRA:
+      StoreRGBA(out, in, width, num_channels, true, false, premultiply_alpha);
+      break;
+    case PixelFormat::kBGRX:
+      StoreRGBA(out, in, width, num_channels, true, true, false);
+      break;
+    case PixelFormat::kRGB565:
+      switch (num_channels) {
+        case 1:
+          StoreRGB565<1>(out, in, width);
+          break;
+        case 2:
+          StoreRGB565<2>(out, in, width);
+          break;
+        case 3:
+          StoreRGB565<3>(out, in, width);
+          break;
+        default:
+          StoreRGB565<4>(out, in, width);
+          break;
+      }
+      break;
+    case PixelFormat::kPlanar:
+    case PixelFormat::kPlanarYCbCr:
+      switch (num_channels) {
+        case 1:
+          std::memcpy(out, in, width);
+          break;
+        case 2:
+          StorePlanar<2>(out, plane_stride, in, width);
+          break;
+        case 3:
+          StorePlanar<3>(out, plane_stride, in, width);
+          break;
+        default:
+          StorePlanar<4>(out, plane_stride, in, width);
+          break;
+      }
+      break;
+    case PixelFormat::kLuma:
+      switch (num_channels) {
+        case 1:
+          std::memcpy(out, in, width);
+          break;
+        case 2:
+          StoreLuma<2>(out, in, width);
+          break;
+        case 3:
+          StoreLuma<3>(out, in, width);
+          break;
+        default:
+          StoreLuma<4>(out, in, width);
+          break;
+      }
+      break;
+    default:
+      std::memcpy(out, in, width * num_channels);
+      break;
+  }
+}
+
+}  // namespace himg
@@ -0,0 +1,67 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef PIXEL_FORMAT_H_
+#define PIXEL_FORMAT_H_
+
+#include <cstdint>
+
+namespace himg {
+
+// Pixel formats that the decoder can produce.
+enum class PixelFormat {
+  // The channels of the image, interleaved (1-4 bytes per pixel).
+  kNative,
+
+  // Four bytes per pixel. Images without alpha get an opaque alpha channel,
+  // and grayscale images are expanded to RGB. For BGRX, the X byte is 255.
+  kRGBA,
+  kBGRA,
+  kBGRX,
+
+  // Two bytes per pixel (little endian): 5 bits red, 6 bits green and 5 bits
+  // blue, from the most significant bit down.
+  kRGB565,
+
+  // One plane of width x height bytes per image channel (R, G, B, A).
+  kPlanar,
+
+  // Same as kPlanar, but color images are kept in the YCbCr color space of the
+  // codec (i.e. no color conversion is done).
+  kPlanarYCbCr,
+
+  // One byte per pixel: the luma (Y) of the image. Only the luma channel of
+  // YCbCr images is decoded (the chroma channels are skipped entirely). For
+  // other color images, the luma is calculated like the Y of the codec.
+  kLuma
+};
+
+class PixelFormatConverter {
+ public:
+  // The number of bytes per pixel in a row (per plane for planar formats).
+  static int BytesPerPixel(PixelFormat format, int num_channels);
+
+  // The number of planes that an image is stored in.
+  static int NumPlanes(PixelFormat format, int num_channels);
+
+  // Store a row of pixels with num_channels interleaved channels in the given
+  // format. For planar formats, the planes are plane_stride bytes apart.
+  // If premultiply_alpha is true, the color of RGBA and BGRA pixels is
+  // multiplied by alpha.
+  static void StoreRow(uint8_t *out,
+                       int plane_stride,
+                       const uint8_t *in,
+                       int width,
+                       int num_channels,
+                       PixelFormat format,
+                       bool premultiply_alpha);
+};
+
+}  // namespace himg
+
+#endif  // PIXEL_FORMAT_H_
@@ -0,0 +1,35 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef PROGRESS_LISTENER_H_
+#define PROGRESS_LISTENER_H_
+
+namespace himg {
+
+// Implement this interface to follow the progress of the decoder, e.g. to show
+// parts of an image before the entire image has been decoded.
+class ProgressListener {
+ public:
+  virtual ~ProgressListener() {}
+
+  // Called when the low resolution data has been decoded. At this point the
+  // output buffer holds a blurry preview of the entire image (interpolated
+  // from the low resolution data), which is then gradually replaced by the
+  // final image.
+  virtual void OnPreview() = 0;
+
+  // Called when num_rows output rows, starting at first_row, hold their final
+  // pixels. Rows are counted from the top of the output image (regardless of
+  // the row order in the output buffer). Block rows are decoded in parallel,
+  // so this may be called from any worker thread, and in any row order.
+  virtual void OnRowsDecoded(int first_row, int num_rows) = 0;
+};
+
+}  // namespace himg
+
+#endif  // PROGRESS_LISTENER_H_
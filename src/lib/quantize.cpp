@@ -127,7 +127,7 @@ void Quantize::InitForQuality(uint8_t quality, bool has_chroma) {
 void Quantize::Pack(uint8_t *out,
                     const int16_t *in,
                     bool chroma_channel,
-                    const Mapper &mapper) {
+                    const Mapper &mapper) const {
   // Select which shift table to use.
   const uint8_t *shift_table =
       chroma_channel ? m_chroma_shift_table : m_shift_table;
@@ -164,6 +164,23 @@ void Quantize::Unpack(int16_t *out,
   }
 }
 
+void Quantize::UnpackReduced(int16_t *out,
+                             const uint8_t *in,
+                             int size,
+                             bool chroma_channel,
+                             const Mapper &mapper) const {
+  // Select which shift table to use.
+  const uint8_t *shift_table =
+      chroma_channel ? m_chroma_shift_table : m_shift_table;
+
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      int i = y * 8 + x;
+      out[i] = mapper.UnmapFrom8Bit(in[i]) << shift_table[i];
+    }
+  }
+}
+
 int Quantize::ConfigurationSize() const {
   // The shift tables require 1/2 a byte (4 bits) per entry, and there are 64
   // entries per table.
@@ -24,7 +24,7 @@ class Quantize {
   void Pack(uint8_t *out,
             const int16_t *in,
             bool chroma_channel,
-            const Mapper &mapper);
+            const Mapper &mapper) const;
 
   // Unpack to 16-bit twos complement based on the shift table.
   void Unpack(int16_t *out,
@@ -32,6 +32,14 @@ class Quantize {
               bool chroma_channel,
               const Mapper &mapper) const;
 
+  // Unpack the size x size lowest frequency coefficients of a block (the
+  // input and the output have a row stride of eight).
+  void UnpackReduced(int16_t *out,
+                     const uint8_t *in,
+                     int size,
+                     bool chroma_channel,
+                     const Mapper &mapper) const;
+
   // Get the required size for the quantization configuration (in bytes).
   int ConfigurationSize() const;
 
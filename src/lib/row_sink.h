@@ -0,0 +1,36 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ROW_SINK_H_
+#define ROW_SINK_H_
+
+#include <cstdint>
+
+namespace himg {
+
+// Implement this interface to receive the decoded image one band of rows at a
+// time (e.g. to pass the rows on to another processing stage), instead of
+// having the decoder store the entire image in a buffer.
+class RowSink {
+ public:
+  virtual ~RowSink() {}
+
+  // Called with num_rows decoded output rows (at most one block row), starting
+  // at first_row. Rows are counted from the top of the output image. The rows
+  // are in the output pixel format, row_stride bytes apart (for planar formats,
+  // the planes are num_rows * row_stride bytes apart). The data is only valid
+  // during the call.
+  virtual void OnRows(int first_row,
+                      int num_rows,
+                      const uint8_t *data,
+                      int row_stride) = 0;
+};
+
+}  // namespace himg
+
+#endif  // ROW_SINK_H_
@@ -0,0 +1,253 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "thread_pool.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace himg {
+
+namespace {
+
+// Tell the CPU that we are in a spin loop.
+inline void CpuRelax() {
+#if defined(__SSE2__)
+  _mm_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+}  // namespace
+
+ThreadPool::Job::Job(int num_tasks, const Task *task)
+    : task(task),
+      num_tasks(num_tasks),
+      next_task(0),
+      unfinished_tasks(num_tasks),
+      next(nullptr),
+      attached_workers(0),
+      queued(false),
+      finished(false),
+      owned_by_pool(false) {
+}
+
+ThreadPool::ThreadPool(int num_threads, const Config &config)
+    : m_config(config),
+      m_stop(false),
+      m_queue_head(nullptr),
+      m_queue_tail(nullptr),
+      m_queued_jobs(0) {
+  const int num_cpus = static_cast<int>(std::thread::hardware_concurrency());
+  if (num_threads <= 0)
+    num_threads = num_cpus;
+
+  // Start N - 1 worker threads (the thread that calls Run() is the Nth thread).
+  for (int i = 0; i < num_threads - 1; ++i) {
+    m_threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+    if (m_config.pin_threads && num_cpus > 0)
+      PinThread(m_threads.back(), (i + 1) % num_cpus);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  // Tell the worker threads to terminate once all queued jobs are done.
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake_cond.notify_all();
+
+  for (auto &thread : m_threads)
+    thread.join();
+}
+
+void ThreadPool::Submit(int num_tasks,
+                        const Task &task,
+                        const Completion &on_complete) {
+  // Without any worker threads, the job is run directly in the calling thread.
+  if (num_tasks <= 0 || m_threads.empty()) {
+    for (int i = 0; i < num_tasks; ++i)
+      task(i, 0);
+    if (on_complete)
+      on_complete();
+    return;
+  }
+
+  Job *job = new Job(num_tasks, nullptr);
+  job->task_storage = task;
+  job->task = &job->task_storage;
+  job->on_complete = on_complete;
+  job->owned_by_pool = true;
+  Enqueue(job);
+}
+
+void ThreadPool::Run(int num_tasks, const Task &task) {
+  // Small jobs are run directly in the calling thread.
+  const int caller_worker = num_workers() - 1;
+  if (num_tasks <= 1 || m_threads.empty()) {
+    for (int i = 0; i < num_tasks; ++i)
+      task(i, caller_worker);
+    return;
+  }
+
+  Job job(num_tasks, &task);
+  Enqueue(&job);
+
+  // One worker is always run in the current thread.
+  RunTasks(&job, caller_worker);
+
+  // Wait for the worker threads to finish (spin first, then sleep). We must
+  // not return until all workers have let go of the job.
+  for (int i = 0; i < m_config.spin_count; ++i) {
+    if (job.unfinished_tasks.load(std::memory_order_acquire) == 0)
+      break;
+    CpuRelax();
+  }
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (!job.finished || job.attached_workers > 0)
+    m_done_cond.wait(lock);
+}
+
+void ThreadPool::WorkerLoop(int worker) {
+  while (Job *job = AttachToJob()) {
+    RunTasks(job, worker);
+    DetachFromJob(job);
+  }
+}
+
+ThreadPool::Job *ThreadPool::AttachToJob() {
+  // Poll for a while...
+  for (int i = 0; i < m_config.spin_count; ++i) {
+    if (m_queued_jobs.load(std::memory_order_acquire) > 0)
+      break;
+    CpuRelax();
+  }
+
+  // ...and then go to sleep until there is a job with tasks left to start.
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    Job *job = FindJob();
+    if (job) {
+      ++job->attached_workers;
+      return job;
+    }
+    if (m_stop)
+      return nullptr;
+    m_wake_cond.wait(lock);
+  }
+}
+
+ThreadPool::Job *ThreadPool::FindJob() {
+  // Note: This must be called with m_mutex held. Jobs that have no more tasks
+  // to start are dropped from the queue on the way.
+  while (m_queue_head) {
+    Job *job = m_queue_head;
+    if (job->next_task.load(std::memory_order_relaxed) < job->num_tasks)
+      return job;
+    Unqueue(job);
+  }
+  return nullptr;
+}
+
+void ThreadPool::DetachFromJob(Job *job) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  --job->attached_workers;
+  if (job->finished && job->attached_workers == 0) {
+    if (job->owned_by_pool) {
+      lock.unlock();
+      delete job;
+    } else {
+      m_done_cond.notify_all();
+    }
+  }
+}
+
+void ThreadPool::RunTasks(Job *job, int worker) {
+  const Task &task = *job->task;
+  const int num_tasks = job->num_tasks;
+  while (true) {
+    int i = job->next_task.fetch_add(1, std::memory_order_relaxed);
+    if (i >= num_tasks)
+      break;
+    task(i, worker);
+    if (job->unfinished_tasks.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      FinishJob(job);
+  }
+}
+
+void ThreadPool::FinishJob(Job *job) {
+  if (job->on_complete)
+    job->on_complete();
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  Unqueue(job);
+  job->finished = true;
+  if (job->attached_workers == 0) {
+    if (job->owned_by_pool) {
+      lock.unlock();
+      delete job;
+    } else {
+      m_done_cond.notify_all();
+    }
+  }
+}
+
+void ThreadPool::Enqueue(Job *job) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_queue_tail)
+      m_queue_tail->next = job;
+    else
+      m_queue_head = job;
+    m_queue_tail = job;
+    job->queued = true;
+    m_queued_jobs.fetch_add(1, std::memory_order_release);
+  }
+  m_wake_cond.notify_all();
+}
+
+void ThreadPool::Unqueue(Job *job) {
+  // Note: This must be called with m_mutex held.
+  if (!job->queued)
+    return;
+  Job *prev = nullptr;
+  for (Job *j = m_queue_head; j != job; j = j->next)
+    prev = j;
+  if (prev)
+    prev->next = job->next;
+  else
+    m_queue_head = job->next;
+  if (m_queue_tail == job)
+    m_queue_tail = prev;
+  job->next = nullptr;
+  job->queued = false;
+  m_queued_jobs.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ThreadPool::PinThread(std::thread &thread, int cpu) {
+#if defined(__linux__)
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set), &cpu_set);
+#else
+  // TODO(m): Implement thread pinning for other platforms.
+  (void)thread;
+  (void)cpu;
+#endif
+}
+
+}  // namespace himg
@@ -0,0 +1,109 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "executor.h"
+
+namespace himg {
+
+// A pool of persistent worker threads. The workers are parked between jobs, so
+// that running a job does not involve any thread creation.
+class ThreadPool : public Executor {
+ public:
+  struct Config {
+    Config() : pin_threads(false), spin_count(kDefaultSpinCount) {}
+
+    // Pin each worker thread to a separate CPU core (if supported).
+    bool pin_threads;
+
+    // The number of times that a parked thread polls for new work before it
+    // goes to sleep (0 = sleep immediately).
+    int spin_count;
+  };
+
+  // Create a pool that runs up to num_threads tasks concurrently (0 = one per
+  // hardware thread). The thread that calls Run() is one of those threads, so
+  // num_threads - 1 worker threads are started.
+  explicit ThreadPool(int num_threads, const Config &config = Config());
+  ~ThreadPool() override;
+
+  int num_workers() const override {
+    return static_cast<int>(m_threads.size()) + 1;
+  }
+
+  void Submit(int num_tasks,
+              const Task &task,
+              const Completion &on_complete) override;
+
+  // Run all the tasks and wait for them to finish. The calling thread takes
+  // part in running the tasks (as the last worker).
+  void Run(int num_tasks, const Task &task) override;
+
+ private:
+  static const int kDefaultSpinCount = 1000;
+
+  struct Job {
+    Job(int num_tasks, const Task *task);
+
+    const Task *task;
+    int num_tasks;
+    std::atomic_int next_task;
+    std::atomic_int unfinished_tasks;
+
+    // Only used by Submit().
+    Task task_storage;
+    Completion on_complete;
+
+    // The following members are protected by m_mutex.
+    Job *next;
+    int attached_workers;
+    bool queued;
+    bool finished;
+    bool owned_by_pool;
+  };
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void WorkerLoop(int worker);
+  Job *AttachToJob();
+  Job *FindJob();
+  void DetachFromJob(Job *job);
+  void RunTasks(Job *job, int worker);
+  void FinishJob(Job *job);
+  void Enqueue(Job *job);
+  void Unqueue(Job *job);
+  void PinThread(std::thread &thread, int cpu);
+
+  const Config m_config;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake_cond;
+  std::condition_variable m_done_cond;
+  bool m_stop;
+
+  // Queue of jobs that may have tasks left to start (protected by m_mutex).
+  Job *m_queue_head;
+  Job *m_queue_tail;
+
+  // The number of jobs in the queue (used for polling without locking).
+  std::atomic_int m_queued_jobs;
+};
+
+}  // namespace himg
+
+#endif  // THREAD_POOL_H_
@@ -10,6 +10,12 @@
 
 #include "common.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace himg {
 
 // We use a multiplier-less approximation:
@@ -20,6 +26,285 @@ namespace himg {
 //   G = Y - (Cb + Cr) / 4
 //   B = G + Cb
 //   R = G + Cr
+//
+// Since the transform only uses additions and shifts, it maps well onto 16-bit
+// SIMD arithmetic. The SIMD code paths handle interleaved three- and
+// four-channel pixels (16 pixels at a time), and are bit-exact with the scalar
+// code.
+
+namespace {
+
+inline void PixelToYCbCr(uint8_t *out, const uint8_t *in, int num_channels) {
+  int16_t r = static_cast<int16_t>(in[0]);
+  int16_t g = static_cast<int16_t>(in[1]);
+  int16_t b = static_cast<int16_t>(in[2]);
+  int16_t y = (r + 2 * g + b + 2) >> 2;
+  int16_t cb = (b - g + 256) >> 1;
+  int16_t cr = (r - g + 256) >> 1;
+  out[0] = static_cast<uint8_t>(y);
+  out[1] = static_cast<uint8_t>(cb);
+  out[2] = static_cast<uint8_t>(cr);
+
+  // Append remaining channels as-is (e.g. alpha).
+  for (int chan = 3; chan < num_channels; ++chan) {
+    out[chan] = in[chan];
+  }
+}
+
+inline void PixelToRGB(uint8_t *buf) {
+  int16_t y = static_cast<int16_t>(buf[0]);
+  int16_t cb = (static_cast<int16_t>(buf[1]) << 1) - 255;
+  int16_t cr = (static_cast<int16_t>(buf[2]) << 1) - 255;
+  int16_t g = y - ((cb + cr + 2) >> 2);
+  int16_t b = g + cb;
+  int16_t r = g + cr;
+  if (LIKELY(((r | g | b) & 0xff00) == 0)) {
+    buf[0] = static_cast<uint8_t>(r);
+    buf[1] = static_cast<uint8_t>(g);
+    buf[2] = static_cast<uint8_t>(b);
+  } else {
+    buf[0] = ClampTo8Bit(r);
+    buf[1] = ClampTo8Bit(g);
+    buf[2] = ClampTo8Bit(b);
+  }
+
+  // Note: Remaining channels are kept as-is (e.g. alpha).
+}
+
+#if defined(__SSE2__)
+// Load 16 three-channel pixels, and split them into one vector per channel.
+inline void Load3(const uint8_t *in, __m128i *c0, __m128i *c1, __m128i *c2) {
+  const __m128i t00 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+  const __m128i t01 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 16));
+  const __m128i t02 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 32));
+
+  const __m128i t10 = _mm_unpacklo_epi8(t00, _mm_unpackhi_epi64(t01, t01));
+  const __m128i t11 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t00, t00), t02);
+  const __m128i t12 = _mm_unpacklo_epi8(t01, _mm_unpackhi_epi64(t02, t02));
+
+  const __m128i t20 = _mm_unpacklo_epi8(t10, _mm_unpackhi_epi64(t11, t11));
+  const __m128i t21 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t10, t10), t12);
+  const __m128i t22 = _mm_unpacklo_epi8(t11, _mm_unpackhi_epi64(t12, t12));
+
+  const __m128i t30 = _mm_unpacklo_epi8(t20, _mm_unpackhi_epi64(t21, t21));
+  const __m128i t31 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t20, t20), t22);
+  const __m128i t32 = _mm_unpacklo_epi8(t21, _mm_unpackhi_epi64(t22, t22));
+
+  *c0 = _mm_unpacklo_epi8(t30, _mm_unpackhi_epi64(t31, t31));
+  *c1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t30, t30), t32);
+  *c2 = _mm_unpacklo_epi8(t31, _mm_unpackhi_epi64(t32, t32));
+}
+
+// Interleave three channel vectors into 16 three-channel pixels.
+inline void Store3(uint8_t *out, __m128i c0, __m128i c1, __m128i c2) {
+  const __m128i zero = _mm_setzero_si128();
+
+  // Form four-byte pixels (with a zero fourth byte).
+  const __m128i c01_lo = _mm_unpacklo_epi8(c0, c1);
+  const __m128i c01_hi = _mm_unpackhi_epi8(c0, c1);
+  const __m128i c2_lo = _mm_unpacklo_epi8(c2, zero);
+  const __m128i c2_hi = _mm_unpackhi_epi8(c2, zero);
+  const __m128i p00 = _mm_unpacklo_epi16(c01_lo, c2_lo);
+  const __m128i p01 = _mm_unpackhi_epi16(c01_lo, c2_lo);
+  const __m128i p02 = _mm_unpacklo_epi16(c01_hi, c2_hi);
+  const __m128i p03 = _mm_unpackhi_epi16(c01_hi, c2_hi);
+
+  // Squeeze out the fourth byte of each pixel.
+  const __m128i p10 = _mm_unpacklo_epi32(p00, p01);
+  const __m128i p11 = _mm_unpackhi_epi32(p00, p01);
+  const __m128i p12 = _mm_unpacklo_epi32(p02, p03);
+  const __m128i p13 = _mm_unpackhi_epi32(p02, p03);
+
+  const __m128i p20 = _mm_slli_si128(_mm_unpacklo_epi64(p10, p11), 1);
+  const __m128i p21 = _mm_unpackhi_epi64(p10, p11);
+  const __m128i p22 = _mm_slli_si128(_mm_unpacklo_epi64(p12, p13), 1);
+  const __m128i p23 = _mm_unpackhi_epi64(p12, p13);
+
+  const __m128i p30 = _mm_slli_epi64(_mm_unpacklo_epi32(p20, p21), 8);
+  const __m128i p31 = _mm_srli_epi64(_mm_unpackhi_epi32(p20, p21), 8);
+  const __m128i p32 = _mm_slli_epi64(_mm_unpacklo_epi32(p22, p23), 8);
+  const __m128i p33 = _mm_srli_epi64(_mm_unpackhi_epi32(p22, p23), 8);
+
+  const __m128i p40 = _mm_unpacklo_epi64(p30, p31);
+  const __m128i p41 = _mm_unpackhi_epi64(p30, p31);
+  const __m128i p42 = _mm_unpacklo_epi64(p32, p33);
+  const __m128i p43 = _mm_unpackhi_epi64(p32, p33);
+
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i *>(out),
+      _mm_or_si128(_mm_srli_si128(p40, 2), _mm_slli_si128(p41, 10)));
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i *>(out + 16),
+      _mm_or_si128(_mm_srli_si128(p41, 6), _mm_slli_si128(p42, 6)));
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i *>(out + 32),
+      _mm_or_si128(_mm_srli_si128(p42, 10), _mm_slli_si128(p43, 2)));
+}
+
+// Load 16 four-channel pixels, and split them into one vector per channel.
+inline void Load4(const uint8_t *in,
+                  __m128i *c0,
+                  __m128i *c1,
+                  __m128i *c2,
+                  __m128i *c3) {
+  const __m128i u0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+  const __m128i u1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 16));
+  const __m128i u2 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 32));
+  const __m128i u3 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 48));
+
+  const __m128i t0 = _mm_unpacklo_epi8(u0, u1);
+  const __m128i t1 = _mm_unpackhi_epi8(u0, u1);
+  const __m128i t2 = _mm_unpacklo_epi8(u2, u3);
+  const __m128i t3 = _mm_unpackhi_epi8(u2, u3);
+
+  const __m128i s0 = _mm_unpacklo_epi8(t0, t1);
+  const __m128i s1 = _mm_unpackhi_epi8(t0, t1);
+  const __m128i s2 = _mm_unpacklo_epi8(t2, t3);
+  const __m128i s3 = _mm_unpackhi_epi8(t2, t3);
+
+  const __m128i q0 = _mm_unpacklo_epi8(s0, s1);
+  const __m128i q1 = _mm_unpackhi_epi8(s0, s1);
+  const __m128i q2 = _mm_unpacklo_epi8(s2, s3);
+  const __m128i q3 = _mm_unpackhi_epi8(s2, s3);
+
+  *c0 = _mm_unpacklo_epi64(q0, q2);
+  *c1 = _mm_unpackhi_epi64(q0, q2);
+  *c2 = _mm_unpacklo_epi64(q1, q3);
+  *c3 = _mm_unpackhi_epi64(q1, q3);
+}
+
+// Interleave four channel vectors into 16 four-channel pixels.
+inline void Store4(uint8_t *out,
+                   __m128i c0,
+                   __m128i c1,
+                   __m128i c2,
+                   __m128i c3) {
+  const __m128i c01_lo = _mm_unpacklo_epi8(c0, c1);
+  const __m128i c01_hi = _mm_unpackhi_epi8(c0, c1);
+  const __m128i c23_lo = _mm_unpacklo_epi8(c2, c3);
+  const __m128i c23_hi = _mm_unpackhi_epi8(c2, c3);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                   _mm_unpacklo_epi16(c01_lo, c23_lo));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16),
+                   _mm_unpackhi_epi16(c01_lo, c23_lo));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 32),
+                   _mm_unpacklo_epi16(c01_hi, c23_hi));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 48),
+                   _mm_unpackhi_epi16(c01_hi, c23_hi));
+}
+
+#if defined(__AVX2__)
+// With AVX2, all 16 pixels fit in a single vector of 16-bit values.
+inline __m128i PackTo8Bit(__m256i x) {
+  return _mm_packus_epi16(_mm256_castsi256_si128(x),
+                          _mm256_extracti128_si256(x, 1));
+}
+
+// Convert 16 pixels from RGB to YCbCr, one vector per channel.
+inline void VectorToYCbCr(__m128i *c0, __m128i *c1, __m128i *c2) {
+  const __m256i r = _mm256_cvtepu8_epi16(*c0);
+  const __m256i g = _mm256_cvtepu8_epi16(*c1);
+  const __m256i b = _mm256_cvtepu8_epi16(*c2);
+  const __m256i y = _mm256_add_epi16(_mm256_add_epi16(r, b),
+                                     _mm256_add_epi16(g, g));
+  const __m256i cb = _mm256_sub_epi16(b, g);
+  const __m256i cr = _mm256_sub_epi16(r, g);
+  *c0 = PackTo8Bit(
+      _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(2)), 2));
+  *c1 = PackTo8Bit(
+      _mm256_srli_epi16(_mm256_add_epi16(cb, _mm256_set1_epi16(256)), 1));
+  *c2 = PackTo8Bit(
+      _mm256_srli_epi16(_mm256_add_epi16(cr, _mm256_set1_epi16(256)), 1));
+}
+
+// Convert 16 pixels from YCbCr to RGB, one vector per channel. The saturating
+// pack does the clamping.
+inline void VectorToRGB(__m128i *c0, __m128i *c1, __m128i *c2) {
+  const __m256i bias = _mm256_set1_epi16(255);
+  const __m256i y = _mm256_cvtepu8_epi16(*c0);
+  const __m256i cb = _mm256_sub_epi16(
+      _mm256_slli_epi16(_mm256_cvtepu8_epi16(*c1), 1), bias);
+  const __m256i cr = _mm256_sub_epi16(
+      _mm256_slli_epi16(_mm256_cvtepu8_epi16(*c2), 1), bias);
+  const __m256i g = _mm256_sub_epi16(
+      y,
+      _mm256_srai_epi16(
+          _mm256_add_epi16(_mm256_add_epi16(cb, cr), _mm256_set1_epi16(2)),
+          2));
+  *c0 = PackTo8Bit(_mm256_add_epi16(g, cr));
+  *c1 = PackTo8Bit(g);
+  *c2 = PackTo8Bit(_mm256_add_epi16(g, cb));
+}
+#else
+// Convert eight pixels (16-bit values) from RGB to YCbCr.
+inline void ToYCbCr8(__m128i *c0, __m128i *c1, __m128i *c2) {
+  const __m128i r = *c0;
+  const __m128i g = *c1;
+  const __m128i b = *c2;
+  const __m128i y = _mm_add_epi16(_mm_add_epi16(r, b), _mm_add_epi16(g, g));
+  *c0 = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(2)), 2);
+  *c1 = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(b, g), _mm_set1_epi16(256)),
+                       1);
+  *c2 = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(r, g), _mm_set1_epi16(256)),
+                       1);
+}
+
+// Convert eight pixels (16-bit values) from YCbCr to RGB.
+inline void ToRGB8(__m128i *c0, __m128i *c1, __m128i *c2) {
+  const __m128i bias = _mm_set1_epi16(255);
+  const __m128i y = *c0;
+  const __m128i cb = _mm_sub_epi16(_mm_slli_epi16(*c1, 1), bias);
+  const __m128i cr = _mm_sub_epi16(_mm_slli_epi16(*c2, 1), bias);
+  const __m128i g = _mm_sub_epi16(
+      y,
+      _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(cb, cr), _mm_set1_epi16(2)),
+                     2));
+  *c0 = _mm_add_epi16(g, cr);
+  *c1 = g;
+  *c2 = _mm_add_epi16(g, cb);
+}
+
+// Convert 16 pixels from RGB to YCbCr, one vector per channel.
+inline void VectorToYCbCr(__m128i *c0, __m128i *c1, __m128i *c2) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo0 = _mm_unpacklo_epi8(*c0, zero);
+  __m128i lo1 = _mm_unpacklo_epi8(*c1, zero);
+  __m128i lo2 = _mm_unpacklo_epi8(*c2, zero);
+  __m128i hi0 = _mm_unpackhi_epi8(*c0, zero);
+  __m128i hi1 = _mm_unpackhi_epi8(*c1, zero);
+  __m128i hi2 = _mm_unpackhi_epi8(*c2, zero);
+  ToYCbCr8(&lo0, &lo1, &lo2);
+  ToYCbCr8(&hi0, &hi1, &hi2);
+  *c0 = _mm_packus_epi16(lo0, hi0);
+  *c1 = _mm_packus_epi16(lo1, hi1);
+  *c2 = _mm_packus_epi16(lo2, hi2);
+}
+
+// Convert 16 pixels from YCbCr to RGB, one vector per channel. The saturating
+// pack does the clamping.
+inline void VectorToRGB(__m128i *c0, __m128i *c1, __m128i *c2) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo0 = _mm_unpacklo_epi8(*c0, zero);
+  __m128i lo1 = _mm_unpacklo_epi8(*c1, zero);
+  __m128i lo2 = _mm_unpacklo_epi8(*c2, zero);
+  __m128i hi0 = _mm_unpackhi_epi8(*c0, zero);
+  __m128i hi1 = _mm_unpackhi_epi8(*c1, zero);
+  __m128i hi2 = _mm_unpackhi_epi8(*c2, zero);
+  ToRGB8(&lo0, &lo1, &lo2);
+  ToRGB8(&hi0, &hi1, &hi2);
+  *c0 = _mm_packus_epi16(lo0, hi0);
+  *c1 = _mm_packus_epi16(lo1, hi1);
+  *c2 = _mm_packus_epi16(lo2, hi2);
+}
+#endif  // __AVX2__
+#endif  // __SSE2__
+
+}  // namespace
 
 void YCbCr::RGBToYCbCr(uint8_t *out,
                        const uint8_t *in,
@@ -27,27 +312,35 @@ void YCbCr::RGBToYCbCr(uint8_t *out,
                        int height,
                        int pixel_stride,
                        int num_channels) {
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      // Convert RGB -> YCbCr.
-      int16_t r = static_cast<int16_t>(in[0]);
-      int16_t g = static_cast<int16_t>(in[1]);
-      int16_t b = static_cast<int16_t>(in[2]);
-      int16_t y = (r + 2 * g + b + 2) >> 2;
-      int16_t cb = (b - g + 256) >> 1;
-      int16_t cr = (r - g + 256) >> 1;
-      out[0] = static_cast<uint8_t>(y);
-      out[1] = static_cast<uint8_t>(cb);
-      out[2] = static_cast<uint8_t>(cr);
-
-      // Append remaining channels as-is (e.g. alpha).
-      for (int chan = 3; chan < num_channels; ++chan) {
-        out[chan] = in[chan];
-      }
-
-      in += pixel_stride;
-      out += pixel_stride;
+  // The rows are contiguous in memory, so treat the image as a single row.
+  const int num_pixels = width * height;
+  int x = 0;
+#if defined(__SSE2__)
+  if (pixel_stride == 3 && num_channels == 3) {
+    for (; x + 16 <= num_pixels; x += 16) {
+      __m128i c0, c1, c2;
+      Load3(in, &c0, &c1, &c2);
+      VectorToYCbCr(&c0, &c1, &c2);
+      Store3(out, c0, c1, c2);
+      in += 48;
+      out += 48;
     }
+  } else if (pixel_stride == 4 && num_channels == 4) {
+    for (; x + 16 <= num_pixels; x += 16) {
+      __m128i c0, c1, c2, c3;
+      Load4(in, &c0, &c1, &c2, &c3);
+      VectorToYCbCr(&c0, &c1, &c2);
+      Store4(out, c0, c1, c2, c3);
+      in += 64;
+      out += 64;
+    }
+  }
+#endif
+
+  for (; x < num_pixels; ++x) {
+    PixelToYCbCr(out, in, num_channels);
+    in += pixel_stride;
+    out += pixel_stride;
   }
 }
 
@@ -55,29 +348,32 @@ void YCbCr::YCbCrToRGB(uint8_t *buf,
                        int width,
                        int height,
                        int num_channels) {
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      // Convert YCbCr -> RGB.
-      int16_t y = static_cast<int16_t>(buf[0]);
-      int16_t cb = (static_cast<int16_t>(buf[1]) << 1) - 255;
-      int16_t cr = (static_cast<int16_t>(buf[2]) << 1) - 255;
-      int16_t g = y - ((cb + cr + 2) >> 2);
-      int16_t b = g + cb;
-      int16_t r = g + cr;
-      if (LIKELY(((r | g | b) & 0xff00) == 0)) {
-        buf[0] = static_cast<uint8_t>(r);
-        buf[1] = static_cast<uint8_t>(g);
-        buf[2] = static_cast<uint8_t>(b);
-      } else {
-        buf[0] = ClampTo8Bit(r);
-        buf[1] = ClampTo8Bit(g);
-        buf[2] = ClampTo8Bit(b);
-      }
-
-      // Note: Remaining channels are kept as-is (e.g. alpha).
-
-      buf += num_channels;
+  // The rows are contiguous in memory, so treat the image as a single row.
+  const int num_pixels = width * height;
+  int x = 0;
+#if defined(__SSE2__)
+  if (num_channels == 3) {
+    for (; x + 16 <= num_pixels; x += 16) {
+      __m128i c0, c1, c2;
+      Load3(buf, &c0, &c1, &c2);
+      VectorToRGB(&c0, &c1, &c2);
+      Store3(buf, c0, c1, c2);
+      buf += 48;
     }
+  } else if (num_channels == 4) {
+    for (; x + 16 <= num_pixels; x += 16) {
+      __m128i c0, c1, c2, c3;
+      Load4(buf, &c0, &c1, &c2, &c3);
+      VectorToRGB(&c0, &c1, &c2);
+      Store4(buf, c0, c1, c2, c3);
+      buf += 64;
+    }
+  }
+#endif
+
+  for (; x < num_pixels; ++x) {
+    PixelToRGB(buf);
+    buf += num_channels;
   }
 }
 